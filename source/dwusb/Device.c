@@ -20,6 +20,17 @@ Environment:
 #define DWUSB_BASE 0x3F980000
 #define DWUSB_INT 0x29
 
+#define DWUSB_REGS_SIZE 0x1000
+
+#define DWC_OTG_CORE_GLOBAL_REGS_OFFSET 0x0
+#define DWC_OTG_HOST_GLOBAL_REGS_OFFSET 0x400
+#define DWC_OTG_HOST_PORT_REGS_OFFSET 0x440
+#define DWC_OTG_HOST_CHAN_REGS_OFFSET 0x500
+#define DWC_OTG_CHAN_REGS_OFFSET 0x20
+#define DWC_OTG_PCGCCTL_OFFSET 0xE00
+
+#define DWC_TXFNUM_ALL 0x10
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, dwusbCreateDevice)
 #pragma alloc_text (PAGE, Controller_GetWdfDevice)
@@ -33,17 +44,17 @@ typedef struct _ROOT_HUB_DATA {
 	PEX_TIMER ExTimerResetComplete;
 	PEX_TIMER ExTimerResumeComplete;
 
-	PEX_TIMER ExTimerResetSafeComplete;
-
 	UCXROOTHUB UcxRootHub;
+	PCONTROLLER_DATA ControllerData;
+
+	//
+	// Status change interrupt transfers wait here until the port changes.
+	//
+	WDFQUEUE InterruptQueue;
 
 	BOOLEAN ResetState;
 } ROOTHUB_DATA, *PROOTHUB_DATA;
 
-typedef struct _REQUEST_DATA {
-	int Unused;
-} REQUEST_DATA, *PREQUEST_DATA;
-
 typedef struct _INTERRUPT_CONTEXT {
 	PCONTROLLER_DATA ControllerHandle;
 } INTERRUPT_CONTEXT, *PINTERRUPT_CONTEXT;
@@ -77,6 +88,643 @@ Controller_SetChannelCallback(
 	}
 }
 
+VOID
+Controller_UnmaskChannelInterrupt(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel
+)
+/*++
+
+Routine Description:
+
+Sets the channel's bit in haintmsk. The ISR masks channels as they fire,
+so the shadow is only updated with the interrupt lock held; otherwise a
+write from here could be overtaken by a stale one from the ISR.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+
+	WdfInterruptAcquireLock(data->WdfInterrupt);
+
+	data->HaintmskShadow |= (1 << Channel);
+	data->HostGlobalRegs->haintmsk = data->HaintmskShadow;
+
+	WdfInterruptReleaseLock(data->WdfInterrupt);
+}
+
+VOID
+Controller_WaitForMicroframe(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel,
+	_In_ ULONG Microframe
+)
+/*++
+
+Routine Description:
+
+Resumes the channel's state machine, through ChResumeContexts, from the
+start of the next microframe numbered Microframe (0-7). The SOF interrupt
+paces this; timers can't hit a 125us microframe reliably.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	gintmsk_data_t gintmsk;
+
+	WdfInterruptAcquireLock(data->WdfInterrupt);
+
+	data->ChSofMicroframe[Channel] = (UCHAR)(Microframe & 7);
+	data->SofWaitChannels |= (1 << Channel);
+
+	gintmsk.d32 = data->GintmskShadow;
+
+	if (!gintmsk.b.sofintr)
+	{
+		// don't take the SOF left over from the last wait
+		gintsts_data_t gintsts;
+		gintsts.d32 = 0;
+		gintsts.b.sofintr = 1;
+		data->CoreGlobalRegs->gintsts = gintsts.d32;
+
+		gintmsk.b.sofintr = 1;
+		data->GintmskShadow = gintmsk.d32;
+		data->CoreGlobalRegs->gintmsk = gintmsk.d32;
+	}
+
+	WdfInterruptReleaseLock(data->WdfInterrupt);
+}
+
+VOID
+Controller_CancelMicroframeWait(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+
+	WdfInterruptAcquireLock(data->WdfInterrupt);
+
+	data->SofWaitChannels &= ~(1 << Channel);
+	InterlockedAnd(&data->SofReadyChannels, ~(1 << Channel));
+
+	WdfInterruptReleaseLock(data->WdfInterrupt);
+}
+
+VOID
+Controller_ModifyPort(
+	_In_ PCONTROLLER_DATA ControllerData,
+	_In_ ULONG Clear,
+	_In_ ULONG Set
+)
+/*++
+
+Routine Description:
+
+Clears, then sets, bits of hprt0. The read-modify-write runs under the
+interrupt lock, so it cannot interleave with the ISR acknowledging port
+changes. prtena and the change bits are write-1-to-clear, writing prtena
+back would disable the port, so all of them are written as 0; a change
+latched meanwhile is left for the ISR.
+
+--*/
+{
+	hprt0_data_t hprt0;
+
+	WdfInterruptAcquireLock(ControllerData->WdfInterrupt);
+
+	KeMemoryBarrier();
+	_DataSynchronizationBarrier();
+
+	hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)ControllerData->Hprt0);
+	hprt0.b.prtena = 0;
+	hprt0.b.prtconndet = 0;
+	hprt0.b.prtenchng = 0;
+	hprt0.b.prtovrcurrchng = 0;
+
+	hprt0.d32 = (hprt0.d32 & ~Clear) | Set;
+
+	KeMemoryBarrier();
+	_DataSynchronizationBarrier();
+
+	WRITE_REGISTER_ULONG((volatile ULONG*)ControllerData->Hprt0, (ULONG)hprt0.d32);
+
+	KeMemoryBarrier();
+	_DataSynchronizationBarrier();
+
+	WdfInterruptReleaseLock(ControllerData->WdfInterrupt);
+}
+
+VOID
+Controller_SetChannelTarget(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel,
+	_In_ ULONG ProcessorIndex
+)
+/*++
+
+Routine Description:
+
+Points the completion DPC of a freshly allocated channel at the processor
+that submitted the transfer. Only used with DpcTargetSubmitter; the other
+policies fix the target once in ControllerCreate.
+
+TR_Abort can hand the channel back while the halt interrupt it caused is
+still on its way, so the DPC may be queued for the previous owner. That
+completion is stale, the abort already cleared hcint and the channel
+interrupt mask, and a queued DPC must not be retargeted, so it is taken
+off the queue first. Nothing can queue it again until the new owner arms
+the channel.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	PROCESSOR_NUMBER processorNumber;
+
+	if (data->DpcTargetPolicy != DpcTargetSubmitter ||
+		Channel < 0 || Channel >= 8 ||
+		ProcessorIndex >= data->ProcessorCount)
+	{
+		return;
+	}
+
+	if (NT_SUCCESS(KeGetProcessorNumberFromIndex(ProcessorIndex, &processorNumber)))
+	{
+		KeRemoveQueueDpc(&data->ChCompletionDpc[Channel]);
+
+		KeSetTargetProcessorDpcEx(&data->ChCompletionDpc[Channel], &processorNumber);
+	}
+}
+
+PREQUEST_DATA
+Controller_AcquireRequestData(
+	_In_ UCXCONTROLLER UcxController
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	PREQUEST_DATA requestData;
+
+	PSLIST_ENTRY entry = InterlockedPopEntrySList(&data->RequestPool);
+
+	if (entry != NULL)
+	{
+		requestData = CONTAINING_RECORD(entry, REQUEST_DATA, PoolEntry);
+		requestData->FromPool = TRUE;
+	}
+	else
+	{
+		// more transfers in flight than the pool was sized for
+		requestData = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(REQUEST_DATA), DWUSB_POOL_TAG);
+
+		if (requestData == NULL)
+		{
+			return NULL;
+		}
+
+		requestData->FromPool = FALSE;
+	}
+
+	requestData->TransferBuffer = NULL;
+	requestData->MappingCount = 0;
+
+	return requestData;
+}
+
+VOID
+Controller_ReleaseRequestData(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PREQUEST_DATA RequestData
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+
+	if (RequestData->FromPool)
+	{
+		InterlockedPushEntrySList(&data->RequestPool, &RequestData->PoolEntry);
+	}
+	else
+	{
+		ExFreePoolWithTag(RequestData, DWUSB_POOL_TAG);
+	}
+}
+
+ULONG
+Controller_QueryParameter(
+	_In_ WDFDEVICE WdfDevice,
+	_In_ PCWSTR ValueName,
+	_In_ ULONG DefaultValue
+)
+{
+	WDFKEY key;
+	UNICODE_STRING valueName;
+	ULONG value = DefaultValue;
+
+	NTSTATUS status = WdfDeviceOpenRegistryKey(WdfDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (!NT_SUCCESS(status))
+	{
+		return DefaultValue;
+	}
+
+	RtlInitUnicodeString(&valueName, ValueName);
+
+	if (!NT_SUCCESS(WdfRegistryQueryULong(key, &valueName, &value)))
+	{
+		value = DefaultValue;
+	}
+
+	WdfRegistryClose(key);
+
+	return value;
+}
+
+ULONG
+Controller_ArmTimeout(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTIMER_WHEEL_ENTRY Entry,
+	_In_ ULONG TimeoutMs
+)
+/*++
+
+Routine Description:
+
+Arms Entry to expire TimeoutMs from now, rounded up to whole wheel ticks.
+Returns a cookie that the expiry callback is passed back, so that the owner
+can tell a stale expiry from the one it armed last.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	ULONG64 ticks = (TimeoutMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+	KIRQL oldIrql;
+	ULONG cookie;
+
+	if (ticks == 0)
+	{
+		ticks = 1;
+	}
+
+	KeAcquireSpinLock(&data->TimerWheelLock, &oldIrql);
+
+	if (Entry->Armed)
+	{
+		RemoveEntryList(&Entry->Link);
+		data->TimerWheelCount--;
+	}
+
+	if (++Entry->Cookie == 0)
+	{
+		Entry->Cookie = 1;
+	}
+
+	cookie = Entry->Cookie;
+
+	Entry->Deadline = data->TimerWheelTick + ticks;
+	Entry->Armed = TRUE;
+
+	InsertTailList(&data->TimerWheel[Entry->Deadline % TIMER_WHEEL_SLOTS], &Entry->Link);
+
+	if (data->TimerWheelCount++ == 0)
+	{
+		// the period is in 100ns units, without the sign of a relative due time
+		ExSetTimer(data->TimerWheelTimer,
+			WDF_REL_TIMEOUT_IN_MS(TIMER_WHEEL_TICK_MS),
+			(LONGLONG)TIMER_WHEEL_TICK_MS * 10000,
+			NULL);
+	}
+
+	KeReleaseSpinLock(&data->TimerWheelLock, oldIrql);
+
+	return cookie;
+}
+
+VOID
+Controller_DisarmTimeout(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTIMER_WHEEL_ENTRY Entry
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&data->TimerWheelLock, &oldIrql);
+
+	if (Entry->Armed)
+	{
+		RemoveEntryList(&Entry->Link);
+		Entry->Armed = FALSE;
+
+		if (--data->TimerWheelCount == 0)
+		{
+			ExCancelTimer(data->TimerWheelTimer, NULL);
+		}
+	}
+
+	KeReleaseSpinLock(&data->TimerWheelLock, oldIrql);
+}
+
+VOID
+Controller_TimerWheelTick(
+	_In_ PEX_TIMER Timer,
+	_In_ PVOID Context
+)
+/*++
+
+Routine Description:
+
+Advances the wheel one tick and expires what is due in the new slot.
+Entries further out that hash to the same slot stay put. Expiry callbacks
+run with the wheel lock held, so all they may do is flag their owner.
+
+--*/
+{
+	PCONTROLLER_DATA data = (PCONTROLLER_DATA)Context;
+	KIRQL oldIrql;
+
+	UNREFERENCED_PARAMETER(Timer);
+
+	KeAcquireSpinLock(&data->TimerWheelLock, &oldIrql);
+
+	data->TimerWheelTick++;
+
+	PLIST_ENTRY slot = &data->TimerWheel[data->TimerWheelTick % TIMER_WHEEL_SLOTS];
+	PLIST_ENTRY link = slot->Flink;
+
+	while (link != slot)
+	{
+		PTIMER_WHEEL_ENTRY entry = CONTAINING_RECORD(link, TIMER_WHEEL_ENTRY, Link);
+
+		link = link->Flink;
+
+		if (entry->Deadline > data->TimerWheelTick)
+		{
+			continue;
+		}
+
+		RemoveEntryList(&entry->Link);
+		entry->Armed = FALSE;
+		data->TimerWheelCount--;
+
+		entry->Callback(entry->Context, entry->Cookie);
+	}
+
+	if (data->TimerWheelCount == 0)
+	{
+		ExCancelTimer(data->TimerWheelTimer, NULL);
+	}
+
+	KeReleaseSpinLock(&data->TimerWheelLock, oldIrql);
+}
+
+//
+// Register polling during bring-up runs against a deadline rather than an
+// iteration count, so it neither gives up early on a fast CPU nor spins
+// longer than it must on a slow one. The limits are those of the reference
+// driver.
+//
+#define DWC_AHB_IDLE_TIMEOUT_US 100000
+#define DWC_SOFT_RESET_TIMEOUT_US 10000
+#define DWC_FIFO_FLUSH_TIMEOUT_US 10000
+
+//
+// The databook wants 3 PHY clocks after a soft reset or a FIFO flush before
+// the core is touched again.
+//
+#define DWC_PHY_SETTLE_US 1
+
+BOOLEAN
+Controller_PollRegister(
+	_In_ volatile uint32_t* Register,
+	_In_ ULONG Mask,
+	_In_ ULONG Value,
+	_In_ ULONG TimeoutUs
+)
+/*++
+
+Routine Description:
+
+Waits for the masked register to read Value, for at most TimeoutUs. Safe
+at any IRQL, it only ever stalls.
+
+--*/
+{
+	ULONG64 qpc;
+	ULONG64 deadline = KeQueryInterruptTimePrecise(&qpc) + (ULONG64)TimeoutUs * 10;
+
+	while (1)
+	{
+		KeMemoryBarrier();
+
+		if ((READ_REGISTER_ULONG((volatile ULONG*)Register) & Mask) == Value)
+		{
+			return TRUE;
+		}
+
+		if (KeQueryInterruptTimePrecise(&qpc) > deadline)
+		{
+			// one more look, in case we were held up past the deadline
+			return (READ_REGISTER_ULONG((volatile ULONG*)Register) & Mask) == Value;
+		}
+
+		KeStallExecutionProcessor(1);
+	}
+}
+
+VOID
+Controller_CoreResetStart(
+	_In_ PCONTROLLER_DATA Data
+)
+/*++
+
+Routine Description:
+
+Starts a core soft reset, once the AHB master is idle. The reset runs on
+its own, Controller_CoreResetWait picks it up, so the caller can get other
+work done meanwhile.
+
+--*/
+{
+	grstctl_t grst;
+
+	grst.d32 = 0;
+	grst.b.ahbidle = 1;
+
+	if (!Controller_PollRegister(&Data->CoreGlobalRegs->grstctl, grst.d32, grst.d32, DWC_AHB_IDLE_TIMEOUT_US))
+	{
+		KdPrint((__FUNCTION__ ": AHB master not idle\n"));
+	}
+
+	grst.d32 = Data->CoreGlobalRegs->grstctl;
+	grst.b.csftrst = 1;
+	Data->CoreGlobalRegs->grstctl = grst.d32;
+
+	KeMemoryBarrier();
+}
+
+BOOLEAN
+Controller_CoreResetWait(
+	_In_ PCONTROLLER_DATA Data
+)
+{
+	grstctl_t grst;
+
+	grst.d32 = 0;
+	grst.b.csftrst = 1;
+
+	if (!Controller_PollRegister(&Data->CoreGlobalRegs->grstctl, grst.d32, 0, DWC_SOFT_RESET_TIMEOUT_US))
+	{
+		KdPrint((__FUNCTION__ ": core soft reset timed out\n"));
+		return FALSE;
+	}
+
+	KeStallExecutionProcessor(DWC_PHY_SETTLE_US);
+
+	return TRUE;
+}
+
+ULONG64
+Controller_EndPhase(
+	_In_ PCSTR Phase,
+	_In_ ULONG64 Start
+)
+/*++
+
+Routine Description:
+
+Reports how long a bring-up phase took, and returns the time the next
+phase starts at.
+
+--*/
+{
+	ULONG64 qpc;
+	ULONG64 now = KeQueryInterruptTimePrecise(&qpc);
+
+	UNREFERENCED_PARAMETER(Phase);
+
+	KdPrint(("ControllerCreate: %s took %d us\n", Phase, (ULONG)((now - Start) / 10)));
+
+	return now;
+}
+
+VOID
+Controller_UpdateFifoDemand(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ ULONG MaxPacketSize,
+	_In_ BOOLEAN Add
+)
+/*++
+
+Routine Description:
+
+Accounts a periodic endpoint opening or closing. Each one wants room for
+two packets in the periodic TX FIFO. The FIFOs are repartitioned the next
+time all channels are idle.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	ULONG words = 2 * ((MaxPacketSize + 3) / 4);
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&data->ChannelLock, &oldIrql);
+
+	if (Add)
+	{
+		data->PeriodicFifoWords += words;
+	}
+	else
+	{
+		data->PeriodicFifoWords -= words;
+	}
+
+	data->FifoDirty = TRUE;
+
+	KeReleaseSpinLock(&data->ChannelLock, oldIrql);
+}
+
+VOID
+Controller_ConfigureFifos(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ ULONG PeriodicWords
+)
+/*++
+
+Routine Description:
+
+Splits the data FIFO RAM (GHWCFG3.dfifo_depth words) between RX,
+non-periodic TX and periodic TX as FifoPartition_Compute says, then
+flushes all of them. PeriodicWords is what the open periodic endpoints
+asked for when the caller took the snapshot.
+
+Called without ChannelLock, with FifoBusy set and no channel allocated.
+The flushes poll for up to DWC_FIFO_FLUSH_TIMEOUT_US each.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	hwcfg3_data_t hwcfg3;
+	fifosize_data_t fifosize;
+	FIFO_PARTITION partition;
+	grstctl_t grst;
+
+	hwcfg3.d32 = data->CoreGlobalRegs->ghwcfg3;
+
+	if (!FifoPartition_Compute(hwcfg3.b.dfifo_depth, PeriodicWords, &partition))
+	{
+		KdPrint((__FUNCTION__ ": FIFO depth %d too small, leaving defaults\n", hwcfg3.b.dfifo_depth));
+		return;
+	}
+
+	KdPrint((__FUNCTION__ ": %d words: rx %d nptx %d ptx %d\n",
+		hwcfg3.b.dfifo_depth, partition.Rx, partition.NpTx, partition.PTx));
+
+	data->CoreGlobalRegs->grxfsiz = partition.Rx;
+
+	fifosize.d32 = 0;
+	fifosize.b.startaddr = partition.Rx;
+	fifosize.b.depth = partition.NpTx;
+	data->CoreGlobalRegs->gnptxfsiz = fifosize.d32;
+
+	fifosize.d32 = 0;
+	fifosize.b.startaddr = partition.Rx + partition.NpTx;
+	fifosize.b.depth = partition.PTx;
+	data->CoreGlobalRegs->hptxfsiz = fifosize.d32;
+
+	_DataSynchronizationBarrier();
+	KeMemoryBarrier();
+
+	// flush all TX FIFOs, then RX
+	grst.d32 = 0;
+	grst.b.txfflsh = 1;
+	grst.b.txfnum = DWC_TXFNUM_ALL;
+	data->CoreGlobalRegs->grstctl = grst.d32;
+
+	grst.d32 = 0;
+	grst.b.txfflsh = 1;
+
+	if (!Controller_PollRegister(&data->CoreGlobalRegs->grstctl, grst.d32, 0, DWC_FIFO_FLUSH_TIMEOUT_US))
+	{
+		KdPrint((__FUNCTION__ ": TX FIFO flush timed out\n"));
+	}
+
+	KeStallExecutionProcessor(DWC_PHY_SETTLE_US);
+
+	grst.d32 = 0;
+	grst.b.rxfflsh = 1;
+	data->CoreGlobalRegs->grstctl = grst.d32;
+
+	if (!Controller_PollRegister(&data->CoreGlobalRegs->grstctl, grst.d32, 0, DWC_FIFO_FLUSH_TIMEOUT_US))
+	{
+		KdPrint((__FUNCTION__ ": RX FIFO flush timed out\n"));
+	}
+
+	KeStallExecutionProcessor(DWC_PHY_SETTLE_US);
+}
+
 VOID
 RootHub_UcxEvtGetInfo(
 	UCXROOTHUB  UcxRootHub,
@@ -328,59 +976,94 @@ The request completion status in the WdfRequest.
 }
 
 VOID
-RootHub_UcxEvtInterruptTransfer(
-	__in
-	UCXROOTHUB  UcxRootHub,
+RootHub_CompleteInterruptTransfer(
 	__in
 	WDFREQUEST  WdfRequest
 )
 {
-	NTSTATUS                status = STATUS_SUCCESS;
 	WDF_REQUEST_PARAMETERS  wdfRequestParams;
 	PURB                    urb;
 	ULONG                   transferBufferLength;
 	PVOID                   transferBuffer;
 
-	KdPrint((__FUNCTION__ "\n"));
+	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
+	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
 
-	UNREFERENCED_PARAMETER(UcxRootHub);
+	urb = (PURB)wdfRequestParams.Parameters.Others.Arg1;
+	transferBuffer = urb->UrbBulkOrInterruptTransfer.TransferBuffer;
+	transferBufferLength = urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
 
-	__try
-	{
-		WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
-		WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
+	RtlZeroMemory(transferBuffer, transferBufferLength);
 
-		urb = (PURB)wdfRequestParams.Parameters.Others.Arg1;
-		transferBuffer = urb->UrbBulkOrInterruptTransfer.TransferBuffer;
-		transferBufferLength = urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
+	// port 1 changed
+	((PUCHAR)transferBuffer)[0] |= 1 << 1;
 
-		RtlZeroMemory(transferBuffer, transferBufferLength);
+	urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
 
-		PROOTHUB_DATA rootHubData = RootHubGetData(UcxRootHub);
+	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
+}
 
-		hprt0_data_t hprt0;
+VOID
+RootHub_SignalPortChange(
+	__in
+	PROOTHUB_DATA  RootHubData
+)
+/*++
 
-		KeMemoryBarrier();
-		_DataSynchronizationBarrier();
+Routine Description:
 
-		hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
+Completes the parked status change transfers if the port has a change
+pending. Called from the port interrupt DPC, after a reset, and after a
+transfer is parked in case the change raced with it.
 
-		KeMemoryBarrier();
-		_DataSynchronizationBarrier();
+--*/
+{
+	WDFREQUEST request;
 
-		if (hprt0.b.prtenchng || hprt0.b.prtovrcurrchng || hprt0.b.prtconndet/* || rootHubData->ResetState*/)
-		{
-			// port 1 changed
-			((PUCHAR)transferBuffer)[0] |= 1 << 1;
-		}
-		
-		status = STATUS_SUCCESS;
-		urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+	if (RootHubData->ControllerData->PortChangeBits == 0)
+	{
+		return;
+	}
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(RootHubData->InterruptQueue, &request)))
+	{
+		RootHub_CompleteInterruptTransfer(request);
+	}
+}
+
+VOID
+RootHub_UcxEvtInterruptTransfer(
+	__in
+	UCXROOTHUB  UcxRootHub,
+	__in
+	WDFREQUEST  WdfRequest
+)
+{
+	NTSTATUS                status;
+
+	KdPrint((__FUNCTION__ "\n"));
+
+	PROOTHUB_DATA rootHubData = RootHubGetData(UcxRootHub);
+
+	if (rootHubData->ControllerData->PortChangeBits != 0)
+	{
+		RootHub_CompleteInterruptTransfer(WdfRequest);
+		return;
 	}
-	__finally
+
+	//
+	// Nothing to report, hold on to it rather than have the hub driver
+	// poll us.
+	//
+	status = WdfRequestForwardToIoQueue(WdfRequest, rootHubData->InterruptQueue);
+
+	if (!NT_SUCCESS(status))
 	{
 		WdfRequestComplete(WdfRequest, status);
+		return;
 	}
+
+	RootHub_SignalPortChange(rootHubData);
 }
 
 VOID
@@ -556,13 +1239,7 @@ Return Value:
             // Clearing the PORT_ENABLE feature causes the port
             // to be placed in the Disabled state.
             //
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
-			//hprt0.b.prtena = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			Controller_ModifyPort(rootHubData->ControllerData, 0, 0);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -570,13 +1247,9 @@ Return Value:
 
         case PORT_SUSPEND:
 			
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
+			hprt0.d32 = 0;
 			hprt0.b.prtres = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			Controller_ModifyPort(rootHubData->ControllerData, 0, hprt0.d32);
 
             //
             // Software shall ensure that resume is signaled for at
@@ -595,13 +1268,9 @@ Return Value:
             break;
 
         case PORT_POWER:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
-			hprt0.b.prtpwr = 0;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			hprt0.d32 = 0;
+			hprt0.b.prtpwr = 1;
+			Controller_ModifyPort(rootHubData->ControllerData, hprt0.d32, 0);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -613,9 +1282,10 @@ Return Value:
             break;
 
         case C_PORT_CONNECTION:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
+			// already acknowledged in hardware by the ISR
+			hprt0.d32 = 0;
 			hprt0.b.prtconndet = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			InterlockedAnd(&rootHubData->ControllerData->PortChangeBits, ~(LONG)hprt0.d32);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -629,10 +1299,9 @@ Return Value:
             break;
 
         case C_PORT_ENABLE:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
+			hprt0.d32 = 0;
 			hprt0.b.prtenchng = 1;
-			hprt0.b.prtena = 0; // prtena MUST be 0 to not instantly disable the port
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			InterlockedAnd(&rootHubData->ControllerData->PortChangeBits, ~(LONG)hprt0.d32);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -644,9 +1313,9 @@ Return Value:
             break;
 
         case C_PORT_OVER_CURRENT:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
+			hprt0.d32 = 0;
 			hprt0.b.prtovrcurrchng = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			InterlockedAnd(&rootHubData->ControllerData->PortChangeBits, ~(LONG)hprt0.d32);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -747,16 +1416,9 @@ Return Value:
         switch (featureSelector) {
 
         case PORT_RESET:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
+			hprt0.d32 = 0;
 			hprt0.b.prtrst = 1;
-
-			_DataSynchronizationBarrier();
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
-			_DataSynchronizationBarrier();
+			Controller_ModifyPort(rootHubData->ControllerData, 0, hprt0.d32);
 
 			rootHubData->ResetState = TRUE;
 
@@ -780,26 +1442,18 @@ Return Value:
 
         case PORT_SUSPEND:
 
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
+			hprt0.d32 = 0;
 			hprt0.b.prtsusp = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			Controller_ModifyPort(rootHubData->ControllerData, 0, hprt0.d32);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
             break;
 
         case PORT_POWER:
-			hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-			hprt0.b.prtconndet = 0;
-			hprt0.b.prtena = 0;
-			hprt0.b.prtenchng = 0;
-			hprt0.b.prtovrcurrchng = 0;
+			hprt0.d32 = 0;
 			hprt0.b.prtpwr = 1;
-			WRITE_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0, (ULONG)hprt0.d32);
+			Controller_ModifyPort(rootHubData->ControllerData, 0, hprt0.d32);
 
             urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
             status = STATUS_SUCCESS;
@@ -1144,6 +1798,9 @@ Return Value:
 			pusbPortStatusChange->PortStatus.Usb20PortStatus.HighSpeedDeviceAttached = 
 				(USHORT)(hprt0.b.prtspd == 0);
 
+			// the change bits were acknowledged by the ISR, report the latched ones
+			hprt0.d32 = rootHubData->ControllerData->PortChangeBits;
+
 			pusbPortStatusChange->PortChange.Usb20PortChange.ConnectStatusChange =
 				(USHORT)hprt0.b.prtconndet;
 
@@ -1189,64 +1846,21 @@ RootHub_ResetComplete(
 
 	KdPrint((__FUNCTION__ "\n"));
 
-	KeMemoryBarrier();
-
 	PROOTHUB_DATA rootHub = (PROOTHUB_DATA)Context;
 	hprt0_data_t hprt0;
-	hprt0.d32 = *rootHub->Hprt0;
-
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
-
-	hprt0.b.prtrst = 0;
-
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
-
-	WRITE_REGISTER_ULONG((volatile ULONG*)rootHub->Hprt0, (ULONG)hprt0.d32);
-
-	//UcxRootHubPortChanged(rootHub->UcxRootHub);
-
-	ExSetTimer(rootHub->ExTimerResetSafeComplete,
-		WDF_REL_TIMEOUT_IN_MS(10),
-		0,
-		NULL);
-
-	KeMemoryBarrier();
-}
-
-VOID
-RootHub_ResetSafeComplete(
-	__in
-	PEX_TIMER  Timer,
-	__in_opt
-	PVOID      Context
-)
-{
-	UNREFERENCED_PARAMETER(Timer);
 
-	KdPrint((__FUNCTION__ "\n"));
-
-	PROOTHUB_DATA rootHub = (PROOTHUB_DATA)Context;
-
-	KeMemoryBarrier();
+	hprt0.d32 = 0;
+	hprt0.b.prtrst = 1;
+	Controller_ModifyPort(rootHub->ControllerData, hprt0.d32, 0);
 
-	hprt0_data_t hprt0;
-	hprt0.d32 = *rootHub->Hprt0;
+	//
+	// The port enabling itself raises prtenchng, and the port interrupt
+	// tells UCX about it. GetPortStatus reports the reset change then.
+	//
 
 	KeMemoryBarrier();
 
-	if (hprt0.b.prtenchng || hprt0.b.prtovrcurrchng || hprt0.b.prtconndet/* || rootHubData->ResetState*/)
-	{
-		UcxRootHubPortChanged(rootHub->UcxRootHub);
-	}
-	else
-	{
-		ExSetTimer(rootHub->ExTimerResetSafeComplete,
-			WDF_REL_TIMEOUT_IN_MS(10),
-			0,
-			NULL);
-	}
+	RootHub_SignalPortChange(rootHub);
 }
 
 VOID
@@ -1262,24 +1876,12 @@ RootHub_ResumeComplete(
 	KdPrint((__FUNCTION__ "\n"));
 
 	PROOTHUB_DATA rootHub = (PROOTHUB_DATA)Context;
-
-	KeMemoryBarrier();
-
 	hprt0_data_t hprt0;
-	hprt0.d32 = *rootHub->Hprt0;
-
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
-
-	hprt0.b.prtsusp = 0;
-	hprt0.b.prtres = 0;
-
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
 
-	*rootHub->Hprt0 = hprt0.d32;
-
-	KeMemoryBarrier();
+	hprt0.d32 = 0;
+	hprt0.b.prtsusp = 1;
+	hprt0.b.prtres = 1;
+	Controller_ModifyPort(rootHub->ControllerData, hprt0.d32, 0);
 }
 
 NTSTATUS
@@ -1293,8 +1895,7 @@ RootHubCreate(
 	WDF_OBJECT_ATTRIBUTES   wdfAttributes;
 	UCXROOTHUB              ucxRootHub;
 	PROOTHUB_DATA           rootHubData;
-
-	UNREFERENCED_PARAMETER(WdfDevice);
+	WDF_IO_QUEUE_CONFIG     wdfIoQueueConfig;
 
 	KdPrint((__FUNCTION__ "\n"));
 
@@ -1324,44 +1925,42 @@ RootHubCreate(
 
 	if (NT_SUCCESS(status))
 	{
-		ControllerGetData(UcxController)->RootHub = ucxRootHub;
-
 		rootHubData = RootHubGetData(ucxRootHub);
 
 		rootHubData->ResetState = FALSE;
 		rootHubData->UcxRootHub = ucxRootHub;
+		rootHubData->ControllerData = ControllerGetData(UcxController);
 		rootHubData->ExTimerResetComplete = ExAllocateTimer(RootHub_ResetComplete, rootHubData, EX_TIMER_HIGH_RESOLUTION);
 		rootHubData->ExTimerResumeComplete = ExAllocateTimer(RootHub_ResumeComplete, rootHubData, EX_TIMER_HIGH_RESOLUTION);
-		rootHubData->ExTimerResetSafeComplete = ExAllocateTimer(RootHub_ResetSafeComplete, rootHubData, EX_TIMER_HIGH_RESOLUTION);
 
-		LARGE_INTEGER coreBase;
-		coreBase.QuadPart = DWUSB_BASE + 0x0;
+		rootHubData->CoreGlobalRegs = rootHubData->ControllerData->CoreGlobalRegs;
+		rootHubData->HostGlobalRegs = rootHubData->ControllerData->HostGlobalRegs;
+		rootHubData->Hprt0 = rootHubData->ControllerData->Hprt0;
 
-		LARGE_INTEGER hostBase;
-		hostBase.QuadPart = DWUSB_BASE + 0x400;
+		WDF_IO_QUEUE_CONFIG_INIT(&wdfIoQueueConfig, WdfIoQueueDispatchManual);
+		wdfIoQueueConfig.PowerManaged = WdfFalse;
 
-		LARGE_INTEGER hprt0Base;
-		hprt0Base.QuadPart = DWUSB_BASE + 0x440;
+		WDF_OBJECT_ATTRIBUTES_INIT(&wdfAttributes);
+		wdfAttributes.ParentObject = ucxRootHub;
 
-		rootHubData->CoreGlobalRegs = MmMapIoSpace(coreBase, sizeof(dwc_otg_core_global_regs_t), MmNonCached);
-		rootHubData->HostGlobalRegs = MmMapIoSpace(hostBase, sizeof(dwc_otg_host_global_regs_t), MmNonCached);
-		rootHubData->Hprt0 = MmMapIoSpace(hprt0Base, sizeof(uint32_t), MmNonCached);
+		status = WdfIoQueueCreate(WdfDevice,
+			&wdfIoQueueConfig,
+			&wdfAttributes,
+			&rootHubData->InterruptQueue);
 
-		hprt0_data_t hprt0;
-		hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)rootHubData->Hprt0);
-
-		KeMemoryBarrier();
-		_DataSynchronizationBarrier();
-
-		if (hprt0.b.prtpwr == 0)
+		if (!NT_SUCCESS(status))
 		{
-			hprt0.b.prtpwr = 1;
+			KdPrint((__FUNCTION__ ": WdfIoQueueCreate failed %x\n", status));
+			return status;
+		}
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
+		// the port interrupt DPC only looks at the root hub from here on
+		ControllerGetData(UcxController)->RootHub = ucxRootHub;
 
-			*rootHubData->Hprt0 = hprt0.d32;
-		}
+		hprt0_data_t hprt0;
+		hprt0.d32 = 0;
+		hprt0.b.prtpwr = 1;
+		Controller_ModifyPort(rootHubData->ControllerData, 0, hprt0.d32);
 	}
 
 	return status;
@@ -1374,6 +1973,61 @@ UsbDevice_UcxEvtDeviceAdd(
 	PUCXUSBDEVICE_INIT  UsbDeviceInit
 );
 
+ULONG64
+Controller_GetMicroframeCounter(
+	_In_ UCXCONTROLLER UcxController
+)
+/*++
+
+Routine Description:
+
+Returns a 64-bit monotonic microframe counter whose low 14 bits track
+hfnum.frnum. The core has no frame rollover interrupt, so each call works
+out how far the counter should have moved since the last one using the
+interrupt time, and picks the lap of hfnum.frnum closest to that, see
+FrameCounter_Extend. This stays right however long the gap between
+calls, and is cheap enough (one register read) to use as a timestamp.
+
+The root port of the Pi is always high speed (LAN9514), so hfnum counts
+microframes.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	hfnum_data_t hfnum;
+
+	KeMemoryBarrier();
+	_DataSynchronizationBarrier();
+
+	hfnum.d32 = READ_REGISTER_ULONG((volatile ULONG*)&data->HostGlobalRegs->hfnum);
+
+	ULONG64 now = KeQueryInterruptTime();
+
+	LONG64 last = InterlockedCompareExchange64(&data->MicroframeCounter, 0, 0);
+	LONG64 lastTime = InterlockedCompareExchange64(&data->MicroframeTime, 0, 0);
+
+	LONG64 counter = FrameCounter_Extend(last, now - lastTime, hfnum.b.frnum);
+
+	while (1)
+	{
+		// the frame counter stops while the port is reset, never go back
+		if (counter <= last)
+		{
+			return last;
+		}
+
+		LONG64 seen = InterlockedCompareExchange64(&data->MicroframeCounter, counter, last);
+
+		if (seen == last)
+		{
+			InterlockedExchange64(&data->MicroframeTime, now);
+			return counter;
+		}
+
+		last = seen;
+	}
+}
+
 NTSTATUS
 Controller_UcxEvtGetCurrentFrameNumber(
 	UCXCONTROLLER   UcxController,
@@ -1386,16 +2040,10 @@ Controller_UcxEvtGetCurrentFrameNumber(
 
 	KdPrint((__FUNCTION__ "\n"));
 
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
-
-	hfnum_data_t hfnum;
-	hfnum.d32 = controllerData->HostGlobalRegs->hfnum;
-
-	KeMemoryBarrier();
-	_DataSynchronizationBarrier();
+	UNREFERENCED_PARAMETER(controllerData);
 
-	*FrameNumber = hfnum.b.frnum;
+	// frames, not microframes
+	*FrameNumber = (ULONG)(Controller_GetMicroframeCounter(UcxController) >> 3);
 
 	//*FrameNumber = 0xFFFFFFFF;
 
@@ -1409,50 +2057,41 @@ Controller_UcxEvtReset(
 {
 	UCX_CONTROLLER_RESET_COMPLETE_INFO  ucxControllerResetCompleteInfo;
 	PCONTROLLER_DATA    controllerData;
-	grstctl_t grst;
 
 	KdPrint((__FUNCTION__ "\n"));
 
 	controllerData = ControllerGetData(UcxController);
 
-	// wait for AHBIDLE
-	unsigned int delay = 0x2000;
+	Controller_CoreResetStart(controllerData);
+	Controller_CoreResetWait(controllerData);
 
-	while (delay > 0)
+	//
+	// The soft reset changes the channel registers, haintmsk and gintmsk
+	// behind the shadows' back. The channel shadows take on what the
+	// channels hold now, so the next transfer on each writes whatever
+	// differs from what it needs. The interrupt masks are the driver's to
+	// decide and go back from their shadows.
+	//
+	for (int i = 0; i < 8; i++)
 	{
-		KeMemoryBarrier();
-
-		grst.d32 = controllerData->CoreGlobalRegs->grstctl;
-
-		if (grst.b.ahbidle)
-		{
-			break;
-		}
-
-		delay--;
+		controllerData->ChHcchar[i] = controllerData->ChannelRegs[i]->hcchar;
+		controllerData->ChHcsplt[i] = controllerData->ChannelRegs[i]->hcsplt;
+		controllerData->ChHcintmsk[i] = controllerData->ChannelRegs[i]->hcintmsk;
 	}
 
-	// set CSFTRST
-	delay = 0x2000;
-
-	grst.b.csftrst = 1;
-	controllerData->CoreGlobalRegs->grstctl = grst.d32;
-
-	KeMemoryBarrier();
+	WdfInterruptAcquireLock(controllerData->WdfInterrupt);
 
-	while (delay > 0)
-	{
-		KeMemoryBarrier();
+	controllerData->HostGlobalRegs->haintmsk = controllerData->HaintmskShadow;
+	controllerData->CoreGlobalRegs->gintmsk = controllerData->GintmskShadow;
 
-		grst.d32 = controllerData->CoreGlobalRegs->grstctl;
+	WdfInterruptReleaseLock(controllerData->WdfInterrupt);
 
-		if (!grst.b.csftrst)
-		{
-			break;
-		}
+	// the soft reset may have put the FIFO sizes back to their defaults
+	KIRQL oldIrql;
 
-		delay--;
-	}
+	KeAcquireSpinLock(&controllerData->ChannelLock, &oldIrql);
+	controllerData->FifoDirty = TRUE;
+	KeReleaseSpinLock(&controllerData->ChannelLock, oldIrql);
 
 	UCX_CONTROLLER_RESET_COMPLETE_INFO_INIT(&ucxControllerResetCompleteInfo,
 		UcxControllerStateLost,
@@ -1508,6 +2147,10 @@ Controller_UcxEvtQueryUsbCapability(
 		&GUID_USB_CAPABILITY_CLEAR_TT_BUFFER_ON_ASYNC_TRANSFER_CANCEL,
 		sizeof(GUID)) == sizeof(GUID)) {
 
+		//
+		// TR_ClearTtBuffer sends CLEAR_TT_BUFFER itself when it gives up on
+		// a split. Claiming this would have the hub driver send another.
+		//
 		status = STATUS_NOT_SUPPORTED;
 	}
 	else {
@@ -1531,24 +2174,148 @@ BOOLEAN OnInterruptIsr(WDFINTERRUPT WdfInterrupt, ULONG MessageID)
 
 	gintsts.d32 = context->ControllerHandle->CoreGlobalRegs->gintsts;
 
+	BOOLEAN handled = FALSE;
+
+	if (gintsts.b.portintr)
+	{
+		hprt0_data_t hprt0;
+		hprt0_data_t changes;
+
+		hprt0.d32 = READ_REGISTER_ULONG((volatile ULONG*)context->ControllerHandle->Hprt0);
+
+		changes.d32 = 0;
+		changes.b.prtconndet = hprt0.b.prtconndet;
+		changes.b.prtenchng = hprt0.b.prtenchng;
+		changes.b.prtovrcurrchng = hprt0.b.prtovrcurrchng;
+
+		InterlockedOr(&context->ControllerHandle->PortChangeBits, changes.d32);
+		InterlockedExchange(&context->ControllerHandle->PortChangeSignal, 1);
+
+		// write-1-to-clear the changes we latched, prtena MUST be 0 to not disable the port
+		hprt0.b.prtena = 0;
+
+		KeMemoryBarrier();
+		_DataSynchronizationBarrier();
+
+		WRITE_REGISTER_ULONG((volatile ULONG*)context->ControllerHandle->Hprt0, (ULONG)hprt0.d32);
+
+		KeMemoryBarrier();
+		_DataSynchronizationBarrier();
+
+		handled = TRUE;
+	}
+
 	if (gintsts.b.hcintr)
 	{
+		uint32_t haint = context->ControllerHandle->HostGlobalRegs->haint;
+
+		if (context->ControllerHandle->ThreadedCompletion)
+		{
+			InterlockedOr(&context->ControllerHandle->PendingChannels, haint);
+		}
+
 		// to not re-trigger the interrupt constantly
-		context->ControllerHandle->HostGlobalRegs->haintmsk = (~context->ControllerHandle->HostGlobalRegs->haint) & 0xFFFF;
+		context->ControllerHandle->HaintmskShadow &= ~haint;
+		context->ControllerHandle->HostGlobalRegs->haintmsk = context->ControllerHandle->HaintmskShadow;
 
 		KeMemoryBarrier();
 		_DataSynchronizationBarrier();
 
-		WdfInterruptQueueDpcForIsr(WdfInterrupt);
-		return TRUE;
+		handled = TRUE;
+	}
+
+	if (gintsts.b.sofintr)
+	{
+		PCONTROLLER_DATA data = context->ControllerHandle;
+		gintsts_data_t sof;
+		hfnum_data_t hfnum;
+
+		sof.d32 = 0;
+		sof.b.sofintr = 1;
+		data->CoreGlobalRegs->gintsts = sof.d32;
+
+		hfnum.d32 = data->HostGlobalRegs->hfnum;
+
+		for (int i = 0; i < 8; i++)
+		{
+			if ((data->SofWaitChannels & (1 << i)) &&
+				data->ChSofMicroframe[i] == (hfnum.b.frnum & 7))
+			{
+				data->SofWaitChannels &= ~(1 << i);
+				InterlockedOr(&data->SofReadyChannels, 1 << i);
+			}
+		}
+
+		if (data->SofWaitChannels == 0)
+		{
+			gintmsk_data_t gintmsk;
+			gintmsk.d32 = data->GintmskShadow;
+			gintmsk.b.sofintr = 0;
+			data->GintmskShadow = gintmsk.d32;
+			data->CoreGlobalRegs->gintmsk = gintmsk.d32;
+		}
+
+		KeMemoryBarrier();
+		_DataSynchronizationBarrier();
+
+		// only worth a DPC when a channel's microframe came up
+		if (data->SofReadyChannels != 0)
+		{
+			handled = TRUE;
+		}
+		else if (!handled)
+		{
+			return TRUE;
+		}
 	}
-	else if (gintsts.b.portintr)
+
+	if (handled)
 	{
 		WdfInterruptQueueDpcForIsr(WdfInterrupt);
-		return TRUE;
 	}
 
-	return FALSE;
+	return handled;
+}
+
+VOID
+Controller_RunChannel(
+	PCONTROLLER_DATA ControllerData,
+	int Channel
+)
+{
+	PFN_CHANNEL_CALLBACK cb = ControllerData->ChannelCallbacks[Channel];
+
+	if (cb)
+	{
+		ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+		if (cpu < CONTROLLER_MAX_PROCESSORS)
+		{
+			InterlockedIncrement(&ControllerData->CompletionCount[cpu]);
+		}
+
+		cb(ControllerData->ChannelCallbackContext[Channel]);
+	}
+}
+
+VOID
+Controller_ResumeCh(
+	_In_ PEX_TIMER Timer,
+	_In_ PVOID Context
+);
+
+VOID
+Controller_ChannelDpc(
+	_In_     struct _KDPC *Dpc,
+	_In_opt_ PVOID        DeferredContext,
+	_In_opt_ PVOID        SystemArgument1,
+	_In_opt_ PVOID        SystemArgument2
+)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	Controller_RunChannel((PCONTROLLER_DATA)DeferredContext, (int)(ULONG_PTR)SystemArgument1);
 }
 
 _Use_decl_annotations_
@@ -1567,7 +2334,11 @@ VOID OnInterruptDpc(WDFINTERRUPT WdfInterrupt, WDFOBJECT WdfDevice)
 
 	//KdPrint((__FUNCTION__ "\n"));
 
-	if (gintsts.b.hcintr)
+	if (gintsts.b.hcintr && context->ControllerHandle->ThreadedCompletion)
+	{
+		KeSetEvent(&context->ControllerHandle->WorkerEvent, IO_NO_INCREMENT, FALSE);
+	}
+	else if (gintsts.b.hcintr)
 	{
 		//KdPrint(("hcintr\n"));
 
@@ -1577,17 +2348,33 @@ VOID OnInterruptDpc(WDFINTERRUPT WdfInterrupt, WDFOBJECT WdfDevice)
 		{
 			if (haint & (1 << i))
 			{
-				PFN_CHANNEL_CALLBACK cb = context->ControllerHandle->ChannelCallbacks[i];
-
-				if (cb)
+				if (context->ControllerHandle->DpcTargetPolicy == DpcTargetInterrupt || i >= 8)
 				{
-					cb(context->ControllerHandle->ChannelCallbackContext[i]);
+					Controller_RunChannel(context->ControllerHandle, i);
+				}
+				else
+				{
+					KeInsertQueueDpc(&context->ControllerHandle->ChCompletionDpc[i], (PVOID)(ULONG_PTR)i, NULL);
 				}
 			}
 		}
 	}
-	else if (gintsts.b.portintr)
+
+	LONG sofReady = InterlockedExchange(&context->ControllerHandle->SofReadyChannels, 0);
+
+	for (int i = 0; i < 8; i++)
+	{
+		if ((sofReady & (1 << i)) && context->ControllerHandle->ChResumeContexts[i] != NULL)
+		{
+			Controller_ResumeCh(NULL, &context->ControllerHandle->ChResumeContexts[i]);
+		}
+	}
+
+	if (InterlockedExchange(&context->ControllerHandle->PortChangeSignal, 0) &&
+		context->ControllerHandle->RootHub != NULL)
 	{
+		RootHub_SignalPortChange(RootHubGetData(context->ControllerHandle->RootHub));
+
 		UcxRootHubPortChanged(context->ControllerHandle->RootHub);
 	}
 }
@@ -1595,51 +2382,106 @@ VOID OnInterruptDpc(WDFINTERRUPT WdfInterrupt, WDFOBJECT WdfDevice)
 void DeviceSystemThread(
 	PVOID StartContext
 )
-{
-	UNREFERENCED_PARAMETER(StartContext);
-	/*PCONTROLLER_DATA data = StartContext;
+/*++
 
-	while (TRUE)
-	{
-		LARGE_INTEGER interval;
-		interval.QuadPart = 0;
+Routine Description:
 
-		KeDelayExecutionThread(KernelMode, FALSE, &interval);
+Completion worker used when ThreadedCompletion is set. Runs the channel
+state machines at PASSIVE_LEVEL with real-time priority, so longer
+copies and MDL mapping don't hold the processor at DISPATCH_LEVEL.
+Exits once Controller_EvtCleanup sets WorkerStop.
 
-		gintsts_data_t gintsts;
+--*/
+{
+	PCONTROLLER_DATA data = StartContext;
 
-		KeMemoryBarrier();
-		_DataSynchronizationBarrier();
+	KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 
-		gintsts.d32 = data->CoreGlobalRegs->gintsts;
+	while (TRUE)
+	{
+		KeWaitForSingleObject(&data->WorkerEvent, Executive, KernelMode, FALSE, NULL);
 
-		if (gintsts.b.hcintr)
+		if (data->WorkerStop)
 		{
-			KdPrint(("hcintr\n"));
+			break;
+		}
 
-			uint32_t haint = data->HostGlobalRegs->haint;
+		LONG pending = InterlockedExchange(&data->PendingChannels, 0);
 
-			for (int i = 0; i < 16; i++)
+		for (int i = 0; i < 16; i++)
+		{
+			if (pending & (1 << i))
 			{
-				if (haint & (1 << i))
-				{
-					PFN_CHANNEL_CALLBACK cb = data->ChannelCallbacks[i];
-
-					if (cb)
-					{
-						cb(data->ChannelCallbackContext[i]);
-					}
-				}
+				Controller_RunChannel(data, i);
 			}
 		}
-	}*/
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
 VOID
-Controller_ResumeCh(
-	_In_ PEX_TIMER Timer,
-	_In_ PVOID Context
-);
+Controller_EvtCleanup(
+	_In_ WDFOBJECT UcxController
+)
+{
+	PCONTROLLER_DATA controllerData = ControllerGetData(UcxController);
+
+	//
+	// Teardown goes from the producers of work inwards. The worker runs
+	// channel callbacks, which arm the resume timers, and so do the
+	// completion DPCs; the timers in turn queue state machine DPCs. Each
+	// stage is stopped before what it feeds, and the registers go last.
+	//
+	if (controllerData->WorkerThread != NULL)
+	{
+		InterlockedExchange(&controllerData->WorkerStop, 1);
+		KeSetEvent(&controllerData->WorkerEvent, IO_NO_INCREMENT, FALSE);
+
+		KeWaitForSingleObject(controllerData->WorkerThread, Executive, KernelMode, FALSE, NULL);
+
+		ObDereferenceObject(controllerData->WorkerThread);
+		controllerData->WorkerThread = NULL;
+	}
+
+	KeFlushQueuedDpcs();
+
+	if (controllerData->TimerWheelTimer != NULL)
+	{
+		ExDeleteTimer(controllerData->TimerWheelTimer, TRUE, TRUE, NULL);
+		controllerData->TimerWheelTimer = NULL;
+	}
+
+	for (int i = 0; i < 8; i++)
+	{
+		if (controllerData->ChResumeTimers[i] != NULL)
+		{
+			ExDeleteTimer(controllerData->ChResumeTimers[i], TRUE, TRUE, NULL);
+			controllerData->ChResumeTimers[i] = NULL;
+		}
+	}
+
+	// whatever the timers queued before they were deleted
+	KeFlushQueuedDpcs();
+
+	// nothing can call through these any more
+	for (int i = 0; i < 16; i++)
+	{
+		controllerData->ChannelCallbacks[i] = NULL;
+		controllerData->ChannelCallbackContext[i] = NULL;
+	}
+
+	for (int i = 0; i < CONTROLLER_MAX_PROCESSORS && i < (int)controllerData->ProcessorCount; i++)
+	{
+		KdPrint((__FUNCTION__ ": processor %d ran %d channel completions\n", i, controllerData->CompletionCount[i]));
+	}
+
+	if (controllerData->RegisterBase != NULL)
+	{
+		MmUnmapIoSpace(controllerData->RegisterBase, DWUSB_REGS_SIZE);
+		controllerData->RegisterBase = NULL;
+	}
+}
 
 NTSTATUS
 ControllerCreate(
@@ -1655,8 +2497,11 @@ ControllerCreate(
 	WDF_OBJECT_ATTRIBUTES                   wdfAttributes;
 	UCXCONTROLLER                           ucxController;
 	NTSTATUS status = STATUS_SUCCESS;
+	ULONG64 qpc;
+	ULONG64 phaseStart = KeQueryInterruptTimePrecise(&qpc);
 
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfAttributes, CONTROLLER_DATA);
+	wdfAttributes.EvtCleanupCallback = Controller_EvtCleanup;
 
 	UCX_CONTROLLER_CONFIG_INIT(&ucxControllerConfig, "DWUSB");
 
@@ -1676,26 +2521,26 @@ ControllerCreate(
 
 	PCONTROLLER_DATA controllerData = ControllerGetData(ucxController);
 	controllerData->WdfDevice = WdfDevice;
-	controllerData->UsbAddressInit = 0;
-	controllerData->ChannelMask = 0;
 
-	for (int i = 0; i < 8; i++)
-	{
-		controllerData->ChResumeTimers[i] = ExAllocateTimer(Controller_ResumeCh, &controllerData->ChResumeContexts[i], EX_TIMER_HIGH_RESOLUTION);
-	}
+	LARGE_INTEGER regsBase;
+	regsBase.QuadPart = DWUSB_BASE;
 
-	LARGE_INTEGER coreBase;
-	coreBase.QuadPart = DWUSB_BASE + 0x0;
+	controllerData->RegisterBase = MmMapIoSpace(regsBase, DWUSB_REGS_SIZE, MmNonCached);
 
-	LARGE_INTEGER hostBase;
-	hostBase.QuadPart = DWUSB_BASE + 0x400;
+	if (controllerData->RegisterBase == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
 
-	LARGE_INTEGER pcgcBase;
-	pcgcBase.QuadPart = DWUSB_BASE + 0xE00;
+	controllerData->CoreGlobalRegs = (dwc_otg_core_global_regs_t*)(controllerData->RegisterBase + DWC_OTG_CORE_GLOBAL_REGS_OFFSET);
+	controllerData->HostGlobalRegs = (dwc_otg_host_global_regs_t*)(controllerData->RegisterBase + DWC_OTG_HOST_GLOBAL_REGS_OFFSET);
+	controllerData->PcgcCtl = (volatile uint32_t*)(controllerData->RegisterBase + DWC_OTG_PCGCCTL_OFFSET);
+	controllerData->Hprt0 = (volatile uint32_t*)(controllerData->RegisterBase + DWC_OTG_HOST_PORT_REGS_OFFSET);
 
-	controllerData->CoreGlobalRegs = MmMapIoSpace(coreBase, sizeof(dwc_otg_core_global_regs_t), MmNonCached);
-	controllerData->HostGlobalRegs = MmMapIoSpace(hostBase, sizeof(dwc_otg_host_global_regs_t), MmNonCached);
-	controllerData->PcgcCtl = MmMapIoSpace(pcgcBase, sizeof(uint32_t), MmNonCached);
+	for (int i = 0; i < 16; i++)
+	{
+		controllerData->ChannelRegs[i] = (dwc_otg_hc_regs_t*)(controllerData->RegisterBase +
+			DWC_OTG_HOST_CHAN_REGS_OFFSET + i * DWC_OTG_CHAN_REGS_OFFSET);
+	}
 
 	gusbcfg_data_t gusbcfg;
 	gusbcfg.d32 = controllerData->CoreGlobalRegs->gusbcfg;
@@ -1708,29 +2553,103 @@ ControllerCreate(
 	_DataSynchronizationBarrier();
 	KeMemoryBarrier();
 
-	grstctl_t grst;
-	grst.d32 = controllerData->CoreGlobalRegs->grstctl;
-	int delay = 0x2000;
+	//
+	// The first soft reset takes a while, the software state below is set
+	// up while it runs.
+	//
+	Controller_CoreResetStart(controllerData);
 
-	grst.b.csftrst = 1;
-	controllerData->CoreGlobalRegs->grstctl = grst.d32;
+	phaseStart = Controller_EndPhase("register mapping", phaseStart);
 
-	KeMemoryBarrier();
+	controllerData->ChannelMask = 0;
+
+	KeInitializeSpinLock(&controllerData->ChannelLock);
+	controllerData->FifoDirty = TRUE;
+	controllerData->FifoBusy = FALSE;
+	controllerData->PeriodicFifoWords = 0;
 
-	while (delay > 0)
+	for (int i = 0; i < ChannelPriorityCount; i++)
 	{
-		KeMemoryBarrier();
+		InitializeListHead(&controllerData->ChannelWaiters[i]);
+	}
+
+	controllerData->ReservedChannels = min(Controller_QueryParameter(WdfDevice, L"ReservedChannels", CHANNEL_DEFAULT_RESERVED), 7);
+
+	KeInitializeSpinLock(&controllerData->AddressLock);
 
-		grst.d32 = controllerData->CoreGlobalRegs->grstctl;
+	RtlInitializeBitMap(&controllerData->UsbAddressList.Bitmap,
+		&controllerData->UsbAddressList.Bits[0],
+		USB_MAX_ADDRESS_COUNT);
 
-		if (!grst.b.csftrst)
+	RtlClearAllBits(&controllerData->UsbAddressList.Bitmap);
+	// reserve bit 0 (default address)
+	RtlSetBit(&controllerData->UsbAddressList.Bitmap, 0);
+
+	KeInitializeSpinLock(&controllerData->TtLock);
+
+	KeInitializeSpinLock(&controllerData->TimerWheelLock);
+	controllerData->TimerWheelTimer = ExAllocateTimer(Controller_TimerWheelTick, controllerData, EX_TIMER_HIGH_RESOLUTION);
+	controllerData->TimerWheelTick = 0;
+	controllerData->TimerWheelCount = 0;
+
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+	{
+		InitializeListHead(&controllerData->TimerWheel[i]);
+	}
+
+	for (int i = 0; i < 8; i++)
+	{
+		controllerData->ChResumeTimers[i] = ExAllocateTimer(Controller_ResumeCh, &controllerData->ChResumeContexts[i], EX_TIMER_HIGH_RESOLUTION);
+	}
+
+	controllerData->DpcTargetPolicy = (DPC_TARGET_POLICY)Controller_QueryParameter(WdfDevice, L"DpcTargetPolicy", DpcTargetInterrupt);
+	controllerData->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	controllerData->ThreadedCompletion = Controller_QueryParameter(WdfDevice, L"ThreadedCompletion", 0) != 0;
+	controllerData->PendingChannels = 0;
+	controllerData->WorkerStop = 0;
+	controllerData->WorkerThread = NULL;
+
+	KeInitializeEvent(&controllerData->WorkerEvent, SynchronizationEvent, FALSE);
+
+	KdPrint((__FUNCTION__ ": DPC target policy %d, %d processors, threaded completion %d\n",
+		controllerData->DpcTargetPolicy, controllerData->ProcessorCount, controllerData->ThreadedCompletion));
+
+	ExInitializeSListHead(&controllerData->RequestPool);
+
+	for (int i = 0; i < REQUEST_POOL_SIZE; i++)
+	{
+		InterlockedPushEntrySList(&controllerData->RequestPool, &controllerData->RequestPoolEntries[i].PoolEntry);
+	}
+
+	for (int i = 0; i < 8; i++)
+	{
+		KeInitializeDpc(&controllerData->ChCompletionDpc[i], Controller_ChannelDpc, controllerData);
+
+		//
+		// Targeted DPCs would otherwise wait for the next clock tick on the
+		// remote processor.
+		//
+		KeSetImportanceDpc(&controllerData->ChCompletionDpc[i], MediumHighImportance);
+
+		if (controllerData->DpcTargetPolicy == DpcTargetRoundRobin)
 		{
-			break;
+			PROCESSOR_NUMBER processorNumber;
+
+			if (NT_SUCCESS(KeGetProcessorNumberFromIndex(i % controllerData->ProcessorCount, &processorNumber)))
+			{
+				KeSetTargetProcessorDpcEx(&controllerData->ChCompletionDpc[i], &processorNumber);
+			}
 		}
+	}
 
-		delay--;
+	if (!Controller_CoreResetWait(controllerData))
+	{
+		return STATUS_IO_TIMEOUT;
 	}
 
+	phaseStart = Controller_EndPhase("software setup and first core reset", phaseStart);
+
 	// set PHY config
 	gusbcfg.d32 = controllerData->CoreGlobalRegs->gusbcfg;
 
@@ -1743,29 +2662,16 @@ ControllerCreate(
 	_DataSynchronizationBarrier();
 	KeMemoryBarrier();
 
-	// reset, again
-	delay = 0x2000;
+	// reset again, for the PHY selection to take
+	Controller_CoreResetStart(controllerData);
 
-	grst.d32 = controllerData->CoreGlobalRegs->grstctl;
-	grst.b.csftrst = 1;
-	controllerData->CoreGlobalRegs->grstctl = grst.d32;
-
-	KeMemoryBarrier();
-
-	while (delay > 0)
+	if (!Controller_CoreResetWait(controllerData))
 	{
-		KeMemoryBarrier();
-
-		grst.d32 = controllerData->CoreGlobalRegs->grstctl;
-
-		if (!grst.b.csftrst)
-		{
-			break;
-		}
-
-		delay--;
+		return STATUS_IO_TIMEOUT;
 	}
 
+	phaseStart = Controller_EndPhase("PHY selection and second core reset", phaseStart);
+
 	gusbcfg.d32 = controllerData->CoreGlobalRegs->gusbcfg;
 
 	gusbcfg.b.hnpcap = 1;
@@ -1800,10 +2706,24 @@ ControllerCreate(
 	gintmsk_data_t gintmsk;
 	gintmsk.d32 = 0;
 	gintmsk.b.hcintr = 1;
-	//gintmsk.b.portintr = 1;
+	gintmsk.b.portintr = 1;
+	controllerData->GintmskShadow = gintmsk.d32;
 	controllerData->CoreGlobalRegs->gintmsk = gintmsk.d32;
 
-	controllerData->HostGlobalRegs->haintmsk = 0x1;
+	controllerData->HaintmskShadow = 0x1;
+	controllerData->HostGlobalRegs->haintmsk = controllerData->HaintmskShadow;
+
+	//
+	// Start the microframe counter where the core is. From zero, against
+	// an interrupt time of zero, the first Controller_GetMicroframeCounter
+	// would have to bridge the whole uptime, over which the interrupt time
+	// and the USB clock may drift apart by more than half a lap.
+	//
+	hfnum_data_t hfnum;
+	hfnum.d32 = controllerData->HostGlobalRegs->hfnum;
+
+	controllerData->MicroframeCounter = hfnum.b.frnum & DWC_HFNUM_MAX_FRNUM;
+	controllerData->MicroframeTime = (LONG64)KeQueryInterruptTimePrecise(&qpc);
 
 	for (int i = 0; i < 16; i++)
 	{
@@ -1837,16 +2757,37 @@ ControllerCreate(
 		return status;
 	}
 
-	HANDLE threadHandle;
+	if (controllerData->ThreadedCompletion)
+	{
+		HANDLE threadHandle;
 
-	status = PsCreateSystemThread(&threadHandle, SYNCHRONIZE, NULL, NULL, NULL, DeviceSystemThread, controllerData);
+		status = PsCreateSystemThread(&threadHandle, SYNCHRONIZE, NULL, NULL, NULL, DeviceSystemThread, controllerData);
 
-	if (!NT_SUCCESS(status))
-	{
-		return status;
-	}
+		if (!NT_SUCCESS(status))
+		{
+			return status;
+		}
+
+		// kept referenced, for Controller_EvtCleanup to wait on
+		status = ObReferenceObjectByHandle(threadHandle,
+			SYNCHRONIZE,
+			*PsThreadType,
+			KernelMode,
+			(PVOID*)&controllerData->WorkerThread,
+			NULL);
+
+		ZwClose(threadHandle);
+
+		if (!NT_SUCCESS(status))
+		{
+			controllerData->WorkerThread = NULL;
 
-	ZwClose(threadHandle);
+			InterlockedExchange(&controllerData->WorkerStop, 1);
+			KeSetEvent(&controllerData->WorkerEvent, IO_NO_INCREMENT, FALSE);
+
+			return status;
+		}
+	}
 
 	WDF_DMA_ENABLER_CONFIG   dmaConfig;
 
@@ -1915,6 +2856,8 @@ ControllerCreate(
 
 	InterruptGetData(controllerData->WdfInterrupt)->ControllerHandle = controllerData;
 
+	Controller_EndPhase("host setup, interrupt and buffers", phaseStart);
+
 	return STATUS_SUCCESS;
 }
 
@@ -0,0 +1,98 @@
+/*++
+
+Module Name:
+
+    DeviceTable.h
+
+Abstract:
+
+    Devices of a controller by USB address. The table is plain data,
+    the controller guards it with AddressLock.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+#define USB_MAX_ADDRESS_COUNT 128
+
+typedef struct _USB_DEVICE_TABLE {
+	PVOID Devices[USB_MAX_ADDRESS_COUNT];
+} USB_DEVICE_TABLE, *PUSB_DEVICE_TABLE;
+
+FORCEINLINE
+BOOLEAN
+DeviceTable_Insert(
+	_Inout_ PUSB_DEVICE_TABLE Table,
+	_In_ USHORT Address,
+	_In_ PVOID Device
+)
+/*++
+
+Routine Description:
+
+Enters Device under Address. The default address is never entered, and an
+address another device still holds is refused.
+
+--*/
+{
+	if (Address == 0 || Address >= USB_MAX_ADDRESS_COUNT)
+	{
+		return FALSE;
+	}
+
+	if (Table->Devices[Address] != NULL && Table->Devices[Address] != Device)
+	{
+		return FALSE;
+	}
+
+	Table->Devices[Address] = Device;
+
+	return TRUE;
+}
+
+FORCEINLINE
+VOID
+DeviceTable_Remove(
+	_Inout_ PUSB_DEVICE_TABLE Table,
+	_In_ USHORT Address,
+	_In_ PVOID Device
+)
+/*++
+
+Routine Description:
+
+Removes Device from Address, if it is the device entered there. A device
+that was disabled after its address went to another one leaves that entry
+alone.
+
+--*/
+{
+	if (Address == 0 || Address >= USB_MAX_ADDRESS_COUNT)
+	{
+		return;
+	}
+
+	if (Table->Devices[Address] == Device)
+	{
+		Table->Devices[Address] = NULL;
+	}
+}
+
+FORCEINLINE
+PVOID
+DeviceTable_Lookup(
+	_In_ PUSB_DEVICE_TABLE Table,
+	_In_ USHORT Address
+)
+{
+	if (Address >= USB_MAX_ADDRESS_COUNT)
+	{
+		return NULL;
+	}
+
+	return Table->Devices[Address];
+}
@@ -26,6 +26,11 @@ Environment:
 #include <Wdfusb.h>
 #include <ucx/1.4/ucxclass.h>
 
+#include "DeviceTable.h"
+#include "FifoPartition.h"
+#include "PeriodicBudget.h"
+#include "SubmitRing.h"
+
 typedef enum _USB_HUB_FEATURE_SELECTOR {
 	C_HUB_LOCAL_POWER = 0,
 	C_HUB_OVER_CURRENT = 1
@@ -67,6 +72,50 @@ struct _UCX_URB_DATA {
 
 typedef VOID(*PFN_CHANNEL_CALLBACK)(PVOID);
 
+//
+// Request deadlines share one timer per controller. Entries hash into
+// TIMER_WHEEL_SLOTS buckets by their expiry tick, and the timer only runs
+// while something is armed.
+//
+#define TIMER_WHEEL_SLOTS 64
+#define TIMER_WHEEL_TICK_MS 8
+
+typedef VOID(*PFN_TIMER_WHEEL_CALLBACK)(PVOID, ULONG);
+
+typedef struct _TIMER_WHEEL_ENTRY {
+	LIST_ENTRY Link;
+	ULONG64 Deadline;
+	ULONG Cookie;
+	BOOLEAN Armed;
+	PFN_TIMER_WHEEL_CALLBACK Callback;
+	PVOID Context;
+} TIMER_WHEEL_ENTRY, *PTIMER_WHEEL_ENTRY;
+
+#define DWUSB_POOL_TAG 'bswD'
+
+//
+// Per-transfer context, taken from the controller's pool when a request is
+// accepted and returned when it completes. The transfer buffer is mapped
+// once here, so state machine restarts and retries reuse the mapping.
+//
+typedef struct _REQUEST_DATA {
+	SLIST_ENTRY PoolEntry;
+	BOOLEAN FromPool;
+
+	PVOID TransferBuffer;
+
+	// MDL mappings made for this request, checked at completion
+	ULONG MappingCount;
+
+	//
+	// Setup packet of a control transfer the driver makes itself, such as
+	// SET_ADDRESS. Client control transfers use the one in their URB.
+	//
+	USB_DEFAULT_PIPE_SETUP_PACKET SetupPacket;
+} REQUEST_DATA, *PREQUEST_DATA;
+
+#define REQUEST_POOL_SIZE 64
+
 typedef struct _TRANSFER_URB {
 
 	struct _URB_HEADER Hdr;
@@ -100,6 +149,7 @@ typedef struct _TRANSFER_URB {
 #include "trace.h"
 
 #include "dwc_otg_regs.h"
+#include "FrameCounter.h"
 
 EXTERN_C_START
 
@@ -124,7 +174,122 @@ Controller_SetChannelCallback(
 	_In_opt_ PVOID Context
 );
 
-#define USB_MAX_ADDRESS_COUNT 127
+VOID
+Controller_UnmaskChannelInterrupt(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel
+);
+
+VOID
+Controller_WaitForMicroframe(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel,
+	_In_ ULONG Microframe
+);
+
+VOID
+Controller_CancelMicroframeWait(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel
+);
+
+VOID
+Controller_SetChannelTarget(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ int Channel,
+	_In_ ULONG ProcessorIndex
+);
+
+PREQUEST_DATA
+Controller_AcquireRequestData(
+	_In_ UCXCONTROLLER UcxController
+);
+
+VOID
+Controller_ReleaseRequestData(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PREQUEST_DATA RequestData
+);
+
+ULONG64
+Controller_GetMicroframeCounter(
+	_In_ UCXCONTROLLER UcxController
+);
+
+VOID
+Controller_UpdateFifoDemand(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ ULONG MaxPacketSize,
+	_In_ BOOLEAN Add
+);
+
+VOID
+Controller_ConfigureFifos(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ ULONG PeriodicWords
+);
+
+ULONG
+Controller_ArmTimeout(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTIMER_WHEEL_ENTRY Entry,
+	_In_ ULONG TimeoutMs
+);
+
+VOID
+Controller_DisarmTimeout(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTIMER_WHEEL_ENTRY Entry
+);
+
+UCXUSBDEVICE
+Controller_GetUsbDevice(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ USHORT Address
+);
+
+ULONG
+Controller_QueryParameter(
+	_In_ WDFDEVICE WdfDevice,
+	_In_ PCWSTR ValueName,
+	_In_ ULONG DefaultValue
+);
+
+//
+// Where channel completions run, from the DpcTargetPolicy device parameter.
+//
+typedef enum _DPC_TARGET_POLICY {
+	DpcTargetInterrupt = 0,
+	DpcTargetSubmitter,
+	DpcTargetRoundRobin
+} DPC_TARGET_POLICY;
+
+#define CONTROLLER_MAX_PROCESSORS 8
+
+//
+// Channel grant classes, highest first. A transfer that finds no channel it
+// may take waits in its class and is handed the next one released. Bulk
+// never takes the last ReservedChannels free channels.
+//
+typedef enum _CHANNEL_PRIORITY {
+	ChannelPriorityControl = 0,
+	ChannelPriorityInterrupt,
+	ChannelPriorityBulk,
+	ChannelPriorityCount
+} CHANNEL_PRIORITY;
+
+#define CHANNEL_DEFAULT_RESERVED 1
+
+//
+// TTs with a CLEAR_TT_BUFFER outstanding. No split goes to one until the
+// request completes.
+//
+#define CONTROLLER_MAX_TT_CLEARS 8
+
+typedef struct _TT_CLEAR {
+	INT Hub;
+	INT TtId;
+} TT_CLEAR, *PTT_CLEAR;
 
 typedef struct _USB_ADDRESS_LIST {
 	RTL_BITMAP Bitmap;
@@ -132,10 +297,18 @@ typedef struct _USB_ADDRESS_LIST {
 } USB_ADDRESS_LIST, *PUSB_ADDRESS_LIST;
 
 typedef struct _CONTROLLER_DATA {
+	//
+	// The whole DWC OTG register block is mapped once, at RegisterBase.
+	// The pointers below are typed views into that one mapping.
+	//
+	PUCHAR RegisterBase;
+
 	dwc_otg_core_global_regs_t* CoreGlobalRegs;
 	dwc_otg_host_global_regs_t* HostGlobalRegs;
+	dwc_otg_hc_regs_t* ChannelRegs[16];
 
 	volatile uint32_t* PcgcCtl;
+	volatile uint32_t* Hprt0;
 
 	WDFDEVICE WdfDevice;
 	WDFINTERRUPT WdfInterrupt;
@@ -146,14 +319,13 @@ typedef struct _CONTROLLER_DATA {
 	PVOID CommonBufferBase[8];
 	PHYSICAL_ADDRESS CommonBufferBaseLA[8];
 
-	BOOLEAN UsbAddressInit;
+	//
+	// Devices by USB address, guarded by AddressLock along with the
+	// allocation bitmap. Address 0 is never handed out.
+	//
+	KSPIN_LOCK AddressLock;
 	USB_ADDRESS_LIST UsbAddressList;
-
-	BOOLEAN SmDpcInited;
-	KDPC SmDpc;
-
-	BOOLEAN ChSmDpcInited[8];
-	KDPC ChSmDpc[8];
+	USB_DEVICE_TABLE UsbDevices;
 
 	PEX_TIMER ChResumeTimers[8];
 	PVOID ChResumeContexts[8];
@@ -163,8 +335,97 @@ typedef struct _CONTROLLER_DATA {
 
 	PVOID ChTrDatas[8];
 
+	//
+	// Last values written to the channel registers, haintmsk and gintmsk,
+	// so that programming a channel never has to read them back from the
+	// core. HaintmskShadow and GintmskShadow are shared with the ISR and
+	// only change under the interrupt lock.
+	//
+	ULONG ChHcchar[8];
+	ULONG ChHcsplt[8];
+	ULONG ChHcintmsk[8];
+	ULONG HaintmskShadow;
+	ULONG GintmskShadow;
+
+	//
+	// Channels waiting for a given microframe, see
+	// Controller_WaitForMicroframe. The SOF interrupt is only unmasked while
+	// SofWaitChannels is not empty; the ISR moves channels whose microframe
+	// came up to SofReadyChannels, and the DPC resumes them through
+	// ChResumeContexts. Both change under the interrupt lock.
+	//
+	ULONG SofWaitChannels;
+	volatile LONG SofReadyChannels;
+	UCHAR ChSofMicroframe[8];
+
+	KSPIN_LOCK TtLock;
+	TT_DATA Tts[CONTROLLER_MAX_TTS];
+	ULONG HsPeriodicAllocated;
+
+	// under TtLock, Hub 0 marks a free entry
+	TT_CLEAR TtClears[CONTROLLER_MAX_TT_CLEARS];
+
+	DPC_TARGET_POLICY DpcTargetPolicy;
+	ULONG ProcessorCount;
+	KDPC ChCompletionDpc[8];
+
+	// channel completions run per processor, reported at cleanup
+	volatile LONG CompletionCount[CONTROLLER_MAX_PROCESSORS];
+
+	//
+	// ThreadedCompletion: channel interrupts are handed to DeviceSystemThread
+	// instead of being run from DPCs. The ISR accumulates haint bits in
+	// PendingChannels, the DPC wakes the worker through WorkerEvent.
+	// Controller cleanup sets WorkerStop and waits for WorkerThread to exit.
+	//
+	BOOLEAN ThreadedCompletion;
+	KEVENT WorkerEvent;
+	volatile LONG PendingChannels;
+	volatile LONG WorkerStop;
+	PKTHREAD WorkerThread;
+
+	SLIST_HEADER RequestPool;
+	REQUEST_DATA RequestPoolEntries[REQUEST_POOL_SIZE];
+
 	UCXROOTHUB RootHub;
 
+	//
+	// Port change bits (in hprt0 layout) acknowledged by the ISR and not yet
+	// cleared by the hub driver through ClearPortFeature.
+	//
+	volatile LONG PortChangeBits;
+	volatile LONG PortChangeSignal;
+
+	//
+	// Software extension of hfnum.frnum, see Controller_GetMicroframeCounter.
+	//
+	volatile LONG64 MicroframeCounter;
+	volatile LONG64 MicroframeTime;
+
+	//
+	// FIFO partitioning follows the periodic endpoints that are open, and
+	// is only reprogrammed with every channel idle. The reprogramming runs
+	// outside ChannelLock; FifoBusy, set under it, keeps channels from being
+	// handed out meanwhile.
+	//
+	KSPIN_LOCK ChannelLock;
+	BOOLEAN FifoDirty;
+	BOOLEAN FifoBusy;
+	ULONG PeriodicFifoWords;
+
+	//
+	// Transfers waiting for a channel, per CHANNEL_PRIORITY, under
+	// ChannelLock.
+	//
+	LIST_ENTRY ChannelWaiters[ChannelPriorityCount];
+	ULONG ReservedChannels;
+
+	KSPIN_LOCK TimerWheelLock;
+	PEX_TIMER TimerWheelTimer;
+	LIST_ENTRY TimerWheel[TIMER_WHEEL_SLOTS];
+	ULONG64 TimerWheelTick;
+	ULONG TimerWheelCount;
+
 	volatile char ChannelMask;
 } CONTROLLER_DATA, *PCONTROLLER_DATA;
 
@@ -0,0 +1,85 @@
+/*++
+
+Module Name:
+
+    FifoPartition.h
+
+Abstract:
+
+    How the data FIFO RAM is split between RX, non-periodic TX and
+    periodic TX, see Controller_ConfigureFifos.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+//
+// FIFO sizes are in 32-bit words. RX has to hold two full high speed bulk
+// packets with their status words, non-periodic TX two bulk packets.
+//
+#define DWC_FIFO_RX_MIN 0x104
+#define DWC_FIFO_NPTX_MIN 0x100
+#define DWC_FIFO_PTX_MIN 0x10
+
+typedef struct _FIFO_PARTITION {
+	ULONG Rx;
+	ULONG NpTx;
+	ULONG PTx;
+} FIFO_PARTITION, *PFIFO_PARTITION;
+
+FORCEINLINE
+BOOLEAN
+FifoPartition_Compute(
+	_In_ ULONG Depth,
+	_In_ ULONG PeriodicWords,
+	_Out_ PFIFO_PARTITION Partition
+)
+/*++
+
+Routine Description:
+
+Splits Depth words (GHWCFG3.dfifo_depth) of FIFO RAM. RX gets 3/8 of it,
+at least DWC_FIFO_RX_MIN. Periodic TX gets PeriodicWords, what the open
+periodic endpoints asked for, at least DWC_FIFO_PTX_MIN and bounded so
+that non-periodic TX keeps DWC_FIFO_NPTX_MIN. Non-periodic TX, which is
+what bulk throughput depends on, gets the rest.
+
+Returns FALSE if Depth can't hold all three minimums.
+
+--*/
+{
+	if (Depth < DWC_FIFO_RX_MIN + DWC_FIFO_NPTX_MIN + DWC_FIFO_PTX_MIN)
+	{
+		return FALSE;
+	}
+
+	ULONG rx = (Depth * 3) / 8;
+
+	if (rx < DWC_FIFO_RX_MIN)
+	{
+		rx = DWC_FIFO_RX_MIN;
+	}
+
+	ULONG remaining = Depth - rx;
+	ULONG ptx = PeriodicWords;
+
+	if (ptx < DWC_FIFO_PTX_MIN)
+	{
+		ptx = DWC_FIFO_PTX_MIN;
+	}
+
+	if (ptx > remaining - DWC_FIFO_NPTX_MIN)
+	{
+		ptx = remaining - DWC_FIFO_NPTX_MIN;
+	}
+
+	Partition->Rx = rx;
+	Partition->NpTx = remaining - ptx;
+	Partition->PTx = ptx;
+
+	return TRUE;
+}
@@ -0,0 +1,62 @@
+/*++
+
+Module Name:
+
+    FrameCounter.h
+
+Abstract:
+
+    Extension of the core's 14-bit hfnum.frnum to a 64-bit microframe
+    counter, see Controller_GetMicroframeCounter. DWC_HFNUM_MAX_FRNUM
+    comes from dwc_otg_regs.h.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+// one high speed microframe in KeQueryInterruptTime units
+#define DWC_MICROFRAME_TIME 1250
+#define DWC_FRNUM_LAP (DWC_HFNUM_MAX_FRNUM + 1)
+
+FORCEINLINE
+LONG64
+FrameCounter_Extend(
+	_In_ LONG64 Last,
+	_In_ ULONG64 Elapsed,
+	_In_ ULONG Frnum
+)
+/*++
+
+Routine Description:
+
+The counter value for a read of hfnum.frnum Elapsed interrupt time units
+after the counter was Last. The time says roughly where the counter
+should be now; of the values whose low 14 bits are Frnum, the one
+closest to that is taken. This is exact as long as the time is off by
+less than half a lap (about one second) of microframes, however long
+the gap.
+
+The result may be below Last when the frame counter stood still, as it
+does while the port is reset; the caller keeps the counter from going
+back.
+
+--*/
+{
+	LONG64 expected = Last + (LONG64)(Elapsed / DWC_MICROFRAME_TIME);
+	LONG64 counter = (expected & ~(LONG64)DWC_HFNUM_MAX_FRNUM) | (Frnum & DWC_HFNUM_MAX_FRNUM);
+
+	if (counter - expected > DWC_FRNUM_LAP / 2)
+	{
+		counter -= DWC_FRNUM_LAP;
+	}
+	else if (expected - counter > DWC_FRNUM_LAP / 2)
+	{
+		counter += DWC_FRNUM_LAP;
+	}
+
+	return counter;
+}
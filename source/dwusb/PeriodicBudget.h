@@ -0,0 +1,212 @@
+/*++
+
+Module Name:
+
+    PeriodicBudget.h
+
+Abstract:
+
+    Admission arithmetic for periodic endpoints: the budget of each
+    transaction translator and the high speed share of the microframe.
+    Controller_TtReserve and Controller_HsReserve take TtLock around it.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+//
+// Periodic bandwidth of one transaction translator, in full speed byte
+// times per microframe of the TT's frame (USB 2.0 11.18.1: at most 188
+// per microframe, and only microframes 0 to 5 carry periodic data).
+//
+#define TT_MICROFRAME_BUDGET 188
+#define TT_PERIODIC_MICROFRAMES 6
+#define TT_TRANSACTION_OVERHEAD 13
+#define CONTROLLER_MAX_TTS 16
+
+//
+// High speed periodic traffic may use 80% of a microframe (USB 2.0 5.7.4),
+// in bytes, with a rough per-transaction protocol overhead.
+//
+#define HS_MICROFRAME_BUDGET 6000
+#define HS_TRANSACTION_OVERHEAD 55
+
+typedef struct _TT_DATA {
+	INT Hub;
+	INT Port;
+	ULONG EndpointCount;
+	USHORT Allocated[TT_PERIODIC_MICROFRAMES];
+} TT_DATA, *PTT_DATA;
+
+typedef struct _TT_PLACEMENT {
+	INT Index;
+	ULONG First;
+	ULONG Span;
+	USHORT Share;
+} TT_PLACEMENT, *PTT_PLACEMENT;
+
+FORCEINLINE
+ULONG
+PeriodicBudget_TtCost(
+	_In_ ULONG MaxPacketSize,
+	_In_ BOOLEAN LowSpeed
+)
+/*++
+
+Routine Description:
+
+The payload with worst case bit stuffing plus protocol overhead, in full
+speed byte times; a low speed byte takes eight of them.
+
+--*/
+{
+	ULONG cost = (MaxPacketSize * 7) / 6 + TT_TRANSACTION_OVERHEAD;
+
+	return LowSpeed ? cost * 8 : cost;
+}
+
+FORCEINLINE
+BOOLEAN
+PeriodicBudget_TtReserve(
+	_Inout_ PTT_DATA Tts,
+	_In_ INT Hub,
+	_In_ INT TtId,
+	_In_ ULONG Cost,
+	_Out_ PTT_PLACEMENT Placement
+)
+/*++
+
+Routine Description:
+
+Finds the entry of TT (Hub, TtId) in Tts, or a free one for it, and books
+Cost there. The cost is spread evenly over as many consecutive microframes
+as it needs, and the first placement with room wins. Returns FALSE, with
+nothing booked, if the TT has no room or Tts is full of other TTs.
+
+--*/
+{
+	ULONG span = (Cost + TT_MICROFRAME_BUDGET - 1) / TT_MICROFRAME_BUDGET;
+	ULONG share = span != 0 ? (Cost + span - 1) / span : 0;
+	INT tt = -1;
+
+	Placement->Index = -1;
+
+	if (span == 0 || span > TT_PERIODIC_MICROFRAMES)
+	{
+		return FALSE;
+	}
+
+	for (int i = 0; i < CONTROLLER_MAX_TTS; i++)
+	{
+		if (Tts[i].EndpointCount != 0 &&
+			Tts[i].Hub == Hub &&
+			Tts[i].Port == TtId)
+		{
+			tt = i;
+			break;
+		}
+
+		if (tt < 0 && Tts[i].EndpointCount == 0)
+		{
+			tt = i;
+		}
+	}
+
+	if (tt < 0)
+	{
+		return FALSE;
+	}
+
+	PTT_DATA ttData = &Tts[tt];
+
+	if (ttData->EndpointCount == 0)
+	{
+		RtlZeroMemory(ttData, sizeof(TT_DATA));
+		ttData->Hub = Hub;
+		ttData->Port = TtId;
+	}
+
+	for (ULONG first = 0; first + span <= TT_PERIODIC_MICROFRAMES; first++)
+	{
+		BOOLEAN fits = TRUE;
+
+		for (ULONG j = first; j < first + span; j++)
+		{
+			if (ttData->Allocated[j] + share > TT_MICROFRAME_BUDGET)
+			{
+				fits = FALSE;
+				break;
+			}
+		}
+
+		if (!fits)
+		{
+			continue;
+		}
+
+		for (ULONG j = first; j < first + span; j++)
+		{
+			ttData->Allocated[j] += (USHORT)share;
+		}
+
+		ttData->EndpointCount++;
+
+		Placement->Index = tt;
+		Placement->First = first;
+		Placement->Span = span;
+		Placement->Share = (USHORT)share;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+FORCEINLINE
+VOID
+PeriodicBudget_TtRelease(
+	_Inout_ PTT_DATA Tt,
+	_In_ ULONG First,
+	_In_ ULONG Span,
+	_In_ USHORT Share
+)
+{
+	for (ULONG j = First; j < First + Span; j++)
+	{
+		Tt->Allocated[j] -= Share;
+	}
+
+	Tt->EndpointCount--;
+}
+
+FORCEINLINE
+ULONG
+PeriodicBudget_HsCost(
+	_In_ ULONG MaxPacketSize,
+	_In_ ULONG Mult
+)
+{
+	// every transaction of a high bandwidth endpoint counts
+	return Mult * ((MaxPacketSize * 7) / 6 + HS_TRANSACTION_OVERHEAD);
+}
+
+FORCEINLINE
+BOOLEAN
+PeriodicBudget_HsReserve(
+	_Inout_ PULONG Allocated,
+	_In_ ULONG Cost
+)
+{
+	if (*Allocated + Cost > HS_MICROFRAME_BUDGET)
+	{
+		return FALSE;
+	}
+
+	*Allocated += Cost;
+
+	return TRUE;
+}
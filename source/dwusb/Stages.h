@@ -0,0 +1,185 @@
+/*++
+
+Module Name:
+
+    Stages.h
+
+Abstract:
+
+    The kinds of transfer the driver runs, as stage descriptions, and
+    their layout for one transfer. TR_BuildStages in UsbDevice.c turns
+    the layout into the stages the channel state machine runs.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+//
+// Each kind of transfer is described as data: the stages it runs, and
+// for each stage where its PID, direction and buffer come from.
+// TR_LayoutStages lays a description out for one transfer, TR_BuildStages
+// fills in its buffers and PIDs, and the channel state machine runs the
+// result without knowing which kind it is.
+//
+typedef enum _TR_STAGE_PID
+{
+	StagePidSetup,
+	StagePidData1,
+	StagePidToggle			// the endpoint's data toggle
+} TR_STAGE_PID;
+
+typedef enum _TR_STAGE_DIRECTION
+{
+	StageDirOut,
+	StageDirIn,
+	StageDirUrb,			// as the URB transfer flags say
+	StageDirStatus			// opposite to the data stage, IN without one
+} TR_STAGE_DIRECTION;
+
+typedef enum _TR_STAGE_BUFFER
+{
+	StageBufferSetup,		// the URB setup packet, or the request's own
+	StageBufferTransfer,	// the mapped URB transfer buffer
+	StageBufferStatus		// zero length
+} TR_STAGE_BUFFER;
+
+#define TR_STAGE_OPTIONAL		0x01	// skipped when the URB carries no data
+#define TR_STAGE_REPORT_LENGTH	0x02	// bytes moved go back to the URB
+#define TR_STAGE_ZLP			0x04	// see TR_LayoutStages
+
+typedef struct _TR_STAGE_DESC
+{
+	UCHAR Pid;
+	UCHAR Direction;
+	UCHAR Buffer;
+	UCHAR Flags;
+} TR_STAGE_DESC;
+
+#define TR_KIND_SET_ADDRESS		0x01	// the device takes on the address once done
+#define TR_KIND_CLEAR_TT		0x02	// CLEAR_TT_BUFFER, releases the TT once done
+
+typedef struct _TR_KIND
+{
+	const TR_STAGE_DESC* Stages;
+	UCHAR StageCount;
+	UCHAR Flags;
+} TR_KIND;
+
+static const TR_STAGE_DESC TrControlStages[] =
+{
+	{ StagePidSetup, StageDirOut, StageBufferSetup, 0 },
+	{ StagePidData1, StageDirUrb, StageBufferTransfer, TR_STAGE_OPTIONAL | TR_STAGE_REPORT_LENGTH },
+	{ StagePidData1, StageDirStatus, StageBufferStatus, 0 }
+};
+
+static const TR_STAGE_DESC TrDataStages[] =
+{
+	{ StagePidToggle, StageDirUrb, StageBufferTransfer, TR_STAGE_REPORT_LENGTH | TR_STAGE_ZLP }
+};
+
+static const TR_KIND TrKindControl = { TrControlStages, RTL_NUMBER_OF(TrControlStages), 0 };
+static const TR_KIND TrKindAddress = { TrControlStages, RTL_NUMBER_OF(TrControlStages), TR_KIND_SET_ADDRESS };
+static const TR_KIND TrKindData = { TrDataStages, RTL_NUMBER_OF(TrDataStages), 0 };
+static const TR_KIND TrKindClearTt = { TrControlStages, RTL_NUMBER_OF(TrControlStages), TR_KIND_CLEAR_TT };
+
+#define TR_MAX_STAGES 3
+
+//
+// One stage as TR_LayoutStages lays it out. Buffer is a TR_STAGE_BUFFER
+// and Pid a TR_STAGE_PID; TR_BuildStages resolves both for the transfer.
+//
+typedef struct _TR_STAGE_LAYOUT
+{
+	UCHAR Pid;
+	UCHAR Buffer;
+	BOOLEAN In;
+	BOOLEAN Zlp;
+	BOOLEAN ReportLength;
+	ULONG Length;
+} TR_STAGE_LAYOUT, *PTR_STAGE_LAYOUT;
+
+FORCEINLINE
+ULONG
+TR_LayoutStages(
+	_In_ const TR_KIND* Kind,
+	_In_ BOOLEAN In,
+	_In_ ULONG Length,
+	_In_ ULONG MaxPacketSize,
+	_In_ BOOLEAN ShortOk,
+	_Out_ TR_STAGE_LAYOUT Layout[TR_MAX_STAGES]
+)
+/*++
+
+Routine Description:
+
+Lays out the stages of a transfer of Kind moving Length bytes in the
+direction In says, and returns how many there are. ShortOk is the URB's
+USBD_SHORT_TRANSFER_OK.
+
+--*/
+{
+	PTR_STAGE_LAYOUT stage = Layout;
+
+	for (int i = 0; i < Kind->StageCount; i++)
+	{
+		const TR_STAGE_DESC* desc = &Kind->Stages[i];
+
+		if ((desc->Flags & TR_STAGE_OPTIONAL) && Length == 0)
+		{
+			continue;
+		}
+
+		switch (desc->Direction)
+		{
+		case StageDirOut:
+			stage->In = FALSE;
+			break;
+		case StageDirIn:
+			stage->In = TRUE;
+			break;
+		case StageDirUrb:
+			stage->In = In;
+			break;
+		case StageDirStatus:
+			// opposite to the data, IN when there is none
+			stage->In = (Length) ? !In : TRUE;
+			break;
+		}
+
+		switch (desc->Buffer)
+		{
+		case StageBufferSetup:
+			stage->Length = 8;
+			break;
+		case StageBufferTransfer:
+			stage->Length = Length;
+			break;
+		case StageBufferStatus:
+			stage->Length = 0;
+			break;
+		}
+
+		stage->Pid = desc->Pid;
+		stage->Buffer = desc->Buffer;
+		stage->ReportLength = (desc->Flags & TR_STAGE_REPORT_LENGTH) != 0;
+
+		//
+		// An OUT transfer that fills its last packet exactly needs a zero
+		// length packet to end it, if the client asked for short transfer
+		// semantics.
+		//
+		stage->Zlp = (desc->Flags & TR_STAGE_ZLP) &&
+			!stage->In &&
+			stage->Length != 0 &&
+			(stage->Length % MaxPacketSize) == 0 &&
+			ShortOk;
+
+		stage++;
+	}
+
+	return (ULONG)(stage - Layout);
+}
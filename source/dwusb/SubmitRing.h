@@ -0,0 +1,186 @@
+/*++
+
+Module Name:
+
+    SubmitRing.h
+
+Abstract:
+
+    The bounded MPSC ring endpoints take their transfers from, and the
+    run count that picks the one caller running an endpoint's state
+    machine. Both are lock-free and only use interlocked operations, so
+    this has no dependency on the framework.
+
+    The ring only hands out slot numbers, the user keeps the slots'
+    contents in an array of its own. Producers claim a slot with
+    SubmitRing_Reserve, fill it, and hand it over with SubmitRing_Publish.
+    The single consumer takes it with SubmitRing_Peek, reads it, and
+    gives it back with SubmitRing_Release.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+#define TR_SUBMIT_RING_SIZE 16
+
+typedef struct _TR_SUBMIT_RING {
+	// per slot: its number when free, that plus one once published
+	volatile LONG Sequence[TR_SUBMIT_RING_SIZE];
+	volatile LONG Head;
+	LONG Tail;
+} TR_SUBMIT_RING, *PTR_SUBMIT_RING;
+
+FORCEINLINE
+VOID
+SubmitRing_Init(
+	_Out_ PTR_SUBMIT_RING Ring
+)
+{
+	for (LONG i = 0; i < TR_SUBMIT_RING_SIZE; i++)
+	{
+		Ring->Sequence[i] = i;
+	}
+
+	Ring->Head = 0;
+	Ring->Tail = 0;
+}
+
+FORCEINLINE
+BOOLEAN
+SubmitRing_Reserve(
+	_Inout_ PTR_SUBMIT_RING Ring,
+	_Out_ PULONG Slot
+)
+/*++
+
+Routine Description:
+
+Claims the next free slot for a producer. Returns FALSE if the ring is
+full. The slot is the caller's until it publishes it.
+
+--*/
+{
+	LONG head = Ring->Head;
+
+	while (1)
+	{
+		ULONG slot = (ULONG)head & (TR_SUBMIT_RING_SIZE - 1);
+		LONG diff = Ring->Sequence[slot] - head;
+
+		KeMemoryBarrier();
+
+		if (diff == 0)
+		{
+			LONG seen = InterlockedCompareExchange(&Ring->Head, head + 1, head);
+
+			if (seen == head)
+			{
+				*Slot = slot;
+				return TRUE;
+			}
+
+			head = seen;
+		}
+		else if (diff < 0)
+		{
+			// the consumer hasn't freed this slot yet, the ring is full
+			return FALSE;
+		}
+		else
+		{
+			head = Ring->Head;
+		}
+	}
+}
+
+FORCEINLINE
+VOID
+SubmitRing_Publish(
+	_Inout_ PTR_SUBMIT_RING Ring,
+	_In_ ULONG Slot
+)
+{
+	// the slot's lap is whatever its sequence says, it can't move meanwhile
+	InterlockedExchange(&Ring->Sequence[Slot], Ring->Sequence[Slot] + 1);
+}
+
+FORCEINLINE
+BOOLEAN
+SubmitRing_Peek(
+	_In_ PTR_SUBMIT_RING Ring,
+	_Out_ PULONG Slot
+)
+/*++
+
+Routine Description:
+
+The oldest published slot, for the consumer only. Producers that claimed
+an earlier slot and have not published it yet hold up the ones after.
+
+--*/
+{
+	LONG tail = Ring->Tail;
+	ULONG slot = (ULONG)tail & (TR_SUBMIT_RING_SIZE - 1);
+
+	if (Ring->Sequence[slot] != tail + 1)
+	{
+		return FALSE;
+	}
+
+	KeMemoryBarrier();
+
+	*Slot = slot;
+
+	return TRUE;
+}
+
+FORCEINLINE
+VOID
+SubmitRing_Release(
+	_Inout_ PTR_SUBMIT_RING Ring,
+	_In_ ULONG Slot
+)
+{
+	// hand the slot back to the producers for the next lap
+	InterlockedExchange(&Ring->Sequence[Slot], Ring->Tail + TR_SUBMIT_RING_SIZE);
+
+	Ring->Tail++;
+}
+
+//
+// Whoever bumps the run count from zero becomes the runner. It takes a
+// snapshot of the count before each pass and keeps going until a pass
+// accounts for every caller that arrived meanwhile; those callers just
+// return, their work is picked up by the next pass.
+//
+FORCEINLINE
+BOOLEAN
+RunCount_Enter(
+	_Inout_ volatile LONG* RunCount
+)
+{
+	return InterlockedIncrement(RunCount) == 1;
+}
+
+FORCEINLINE
+LONG
+RunCount_Snapshot(
+	_In_ volatile LONG* RunCount
+)
+{
+	return *RunCount;
+}
+
+FORCEINLINE
+BOOLEAN
+RunCount_Leave(
+	_Inout_ volatile LONG* RunCount,
+	_In_ LONG Snapshot
+)
+{
+	return InterlockedExchangeAdd(RunCount, -Snapshot) == Snapshot;
+}
@@ -15,6 +15,7 @@ Kernel-mode Driver Framework
 --*/
 
 #include "driver.h"
+#include "Stages.h"
 #include "UsbDevice.tmh"
 
 #undef KdPrint
@@ -30,8 +31,15 @@ UsbDevice_UcxEvtDeviceAdd(
 	PUCXUSBDEVICE_INIT  UsbDeviceInit
 );
 
+CHANNEL_PRIORITY
+UsbDevice_QueryChannelPriority(
+	UCXCONTROLLER       UcxController,
+	PUCXUSBDEVICE_INFO  UsbDeviceInfo
+);
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, UsbDevice_UcxEvtDeviceAdd)
+#pragma alloc_text (PAGE, UsbDevice_QueryChannelPriority)
 #endif
 
 typedef struct _USBDEVICE_DATA
@@ -41,11 +49,32 @@ typedef struct _USBDEVICE_DATA
 
 	UCXENDPOINT DefaultEndpoint;
 
-	dwc_otg_host_global_regs_t* HostGlobalRegs;
-	dwc_otg_hc_regs_t* ChannelRegs[16];
+	//
+	// Register mappings are the controller's, shared by every device.
+	//
+	PCONTROLLER_DATA ControllerData;
 
 	ULONG Address;
+
+	//
+	// Address handed out by USBPORT_AllocateUsbAddress, which Address
+	// only takes on once SET_ADDRESS has gone through.
+	//
+	USHORT AssignedAddress;
 	UCXUSBDEVICE_INFO UsbDeviceInfo;
+
+	//
+	// Only valid for hubs, from UsbDevice_UcxEvtHubInfo.
+	//
+	ULONG NumberOfTTs;
+	ULONG TTThinkTime;
+
+	//
+	// Channel class for the device's non-control endpoints, from the
+	// ChannelPriority<port path> device parameter. ChannelPriorityCount
+	// when not overridden.
+	//
+	CHANNEL_PRIORITY ChannelPriority;
 } USBDEVICE_DATA, *PUSBDEVICE_DATA;
 
 typedef enum _ENDPOINT_DIRECTION
@@ -75,43 +104,75 @@ typedef struct _ENDPOINT_DATA
 
 	ULONG MaxPacketSize;
 
+	//
+	// Transactions per microframe, 1 to 3. Only high speed periodic
+	// endpoints go above 1.
+	//
+	UCHAR Mult;
+	USHORT HsCost;
+
 	WDFQUEUE IoQueue;
 
 	UINT8 InToggle;
 	UINT8 OutToggle;
+
+	//
+	// High speed bulk and control OUT: the device NAKed or NYETed the last
+	// packet, so the next one is preceded by a PING (USB 2.0 8.5.1).
+	//
+	BOOLEAN PingState;
+
+	//
+	// Periodic split endpoints: the TT bandwidth reserved at endpoint add
+	// time, and the microframe their start-splits go out in.
+	//
+	INT TtIndex;
+	UCHAR TtStartMicroframe;
+	UCHAR TtSpan;
+	UCHAR TtFirstMicroframe;
+	USHORT TtShare;
+
+	BOOLEAN FifoAccounted;
+
+	CHANNEL_PRIORITY Priority;
 } ENDPOINT_DATA, *PENDPOINT_DATA;
 
+//
+// wMaxPacketSize carries the packet size in bits 10:0 and, for high speed
+// periodic endpoints, the additional transactions per microframe in 12:11.
+//
+#define USB_MAX_PACKET_SIZE(w) ((w) & 0x7FF)
+#define USB_HIGH_BANDWIDTH_MULT(w) ((((w) >> 11) & 3) + 1)
+
+#define USBPORT_INIT_SETUP_PACKET(s, brequest, \
+    direction, recipient, typ, wvalue, windex, wlength) \
+    {\
+    (s).bRequest = (brequest);\
+    (s).bmRequestType.Dir = (direction);\
+    (s).bmRequestType.Type = (typ);\
+    (s).bmRequestType.Recipient = (recipient);\
+    (s).bmRequestType.Reserved = 0;\
+    (s).wValue.W = (wvalue);\
+    (s).wIndex.W = (windex);\
+    (s).wLength = (wlength);\
+    }
+
 typedef enum _CHSM_STATE
 {
 	CHSM_Idle,
-	CHSM_ControlSetup,
-	CHSM_ControlSetupWait,
-	CHSM_ControlSetupDone,
-	CHSM_ControlData,
-	CHSM_ControlDataWait,
-	CHSM_ControlDataDone,
-	CHSM_ControlStatus,
-	CHSM_ControlStatusWait,
-	CHSM_ControlStatusDone,
-	CHSM_AddressSetup,
-	CHSM_AddressSetupWait,
-	CHSM_AddressSetupDone,
-	CHSM_AddressStatus,
-	CHSM_AddressStatusWait,
-	CHSM_AddressStatusDone,
-	CHSM_InterruptOrBulkData,
-	CHSM_InterruptOrBulkDataWait,
-	CHSM_InterruptOrBulkDataDone,
+	CHSM_ChannelWait,
+	CHSM_Stage
 } CHSM_STATE;
 
 typedef struct _CHSM_DATA
 {
 	CHSM_STATE State;
+	const TR_KIND* Kind;
 
 	PTRANSFER_URB Urb;
 	WDFREQUEST Request;
+	PREQUEST_DATA RequestData;
 
-	USHORT Address;
 	INT Channel;
 } CHSM_DATA, *PCHSM_DATA;
 
@@ -125,6 +186,12 @@ typedef enum _TRSM_STATE
 	TRSM_Done
 } TRSM_STATE;
 
+//
+// Frames a periodic start-split may be held back for to catch the
+// microframe its TT budget placed it in.
+//
+#define TR_MAX_SPLIT_WAITS 3
+
 typedef struct _TRSM_DATA
 {
 	TRSM_STATE State;
@@ -137,20 +204,37 @@ typedef struct _TRSM_DATA
 
 	BOOLEAN DoSplit;
 	BOOLEAN CompleteSplit;
+	UCHAR SplitWaits;
+	BOOLEAN ZlpPending;
 	ULONG Done;
 
 	ULONG XferLen;
 	ULONG MaxXferLen;
 	ULONG NumPackets;
 
-	ULONG SSplitFrameNum;
+	ULONG64 SSplitFrameNum;
 
 	INT Channel;
 
 	INT TtHub;
 	INT TtPort;
+	INT TtId;
 } TRSM_DATA, *PTRSM_DATA;
 
+//
+// One stage of a transfer, laid out from its TR_KIND when the transfer
+// gets its channel, see TR_BuildStages.
+//
+typedef struct _TR_STAGE
+{
+	UINT8 Pid;
+	BOOLEAN In;
+	BOOLEAN Zlp;
+	BOOLEAN ReportLength;
+	PVOID Buffer;
+	ULONG Length;
+} TR_STAGE, *PTR_STAGE;
+
 typedef struct _TR_DATA
 {
 	PENDPOINT_DATA EndpointHandle;
@@ -158,16 +242,47 @@ typedef struct _TR_DATA
 	CHSM_DATA StateMachine;
 	TRSM_DATA TrStateMachine;
 
-	CHSM_DATA NextStateMachine;
+	TR_STAGE Stages[TR_MAX_STAGES];
+	INT StageCount;
+	INT Stage;
+
+	//
+	// Bounded MPSC ring of submitted transfers. Client requests are moved
+	// here from the endpoint's manual queue by the runner, in the order the
+	// queue holds them (see TR_PresentNext); the driver's own requests are
+	// pushed from any context. Only the runner pops (see TR_RunChSm), so a
+	// slot's sequence number alone hands it over, see SubmitRing.h.
+	//
+	TR_SUBMIT_RING SubmitRing;
+	CHSM_DATA SubmitSlots[TR_SUBMIT_RING_SIZE];
+
+	volatile LONG RunCount;
+	KDPC RunDpc;
+
+	//
+	// Set by endpoint abort/purge, cleared when the endpoint starts again.
+	// The runner cancels whatever it has in flight and in the ring.
+	//
+	volatile LONG AbortPending;
+
+	//
+	// Channel grant queue, see Controller_AllocateChannel.
+	//
+	LIST_ENTRY ChannelWaitLink;
+	BOOLEAN ChannelWaiting;
+	INT GrantedChannel;
 
-	KSPIN_LOCK SpinLock;
+	//
+	// The URB Timeout of the request in flight, on the controller's timer
+	// wheel. ExpiredCookie is what the wheel hands back when it fires.
+	//
+	TIMER_WHEEL_ENTRY TimeoutEntry;
+	ULONG TimeoutCookie;
+	volatile LONG ExpiredCookie;
 
 	UINT8 StatusBuffer[64];
 } TR_DATA, *PTR_DATA;
 
-#define DWC_OTG_HOST_CHAN_REGS_OFFSET 0x500
-#define DWC_OTG_CHAN_REGS_OFFSET 0x20
-
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ENDPOINT_DATA, GetEndpointData)
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(USBDEVICE_DATA, GetUsbDeviceData)
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TR_DATA, GetTRData)
@@ -178,360 +293,1187 @@ Controller_InvokeTrSm(
 	_In_ PTR_DATA TrData
 );
 
-NTSTATUS
-Controller_AllocateChannel(
-	_In_ UCXCONTROLLER UcxController,
+KDEFERRED_ROUTINE RunSmDpc;
+
+BOOLEAN
+Controller_ClaimChannel(
+	_In_ PCONTROLLER_DATA Data,
+	_In_ CHANNEL_PRIORITY Priority,
 	_Out_ INT* Channel
 )
+/*++
+
+Routine Description:
+
+Takes a free channel for a transfer of the given class, if the class may
+have one. Bulk leaves the last ReservedChannels free channels to control
+and periodic traffic. Nothing is handed out while the FIFOs are being
+reprogrammed. Called with ChannelLock held.
+
+--*/
 {
-	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	ULONG free = 0;
+
+	if (Data->FifoBusy)
+	{
+		return FALSE;
+	}
 
 	for (int i = 0; i < 8; i++)
 	{
-		if (!(data->ChannelMask & (1 << i)))
+		if (!(Data->ChannelMask & (1 << i)))
 		{
-			InterlockedOr8(&data->ChannelMask, 1 << i);
-
-			*Channel = i;
+			free++;
+		}
+	}
 
-			KdPrint((__FUNCTION__ ": Assigned channel %d\n", i));
+	if (free == 0 ||
+		(Priority == ChannelPriorityBulk && free <= Data->ReservedChannels))
+	{
+		return FALSE;
+	}
 
-			return STATUS_SUCCESS;
+	for (int i = 0; i < 8; i++)
+	{
+		if (!(InterlockedOr8(&Data->ChannelMask, 1 << i) & (1 << i)))
+		{
+			*Channel = i;
+			return TRUE;
 		}
 	}
 
-	KdPrint((__FUNCTION__ ": Not enough channels\n"));
-
-	return STATUS_INSUFFICIENT_RESOURCES;
+	return FALSE;
 }
 
-VOID 
-Controller_ReleaseChannel(
-	_In_ UCXCONTROLLER UcxController,
-	_In_ INT Channel
+ULONG
+Controller_GrantWaiters(
+	_In_ PCONTROLLER_DATA Data,
+	_Out_ PTR_DATA* Granted
 )
-{
-	PCONTROLLER_DATA data = ControllerGetData(UcxController);
-	InterlockedAnd8(&data->ChannelMask, ~(1 << Channel));
-}
+/*++
 
-VOID
-TR_RunTrSm(
-	PTR_DATA TrData
-);
+Routine Description:
 
-VOID
-TR_RunChSm(
-	PTR_DATA TrData
-)
+Hands free channels to the first waiters of the highest classes that may
+take them, and returns how many were granted. The caller reruns their
+state machines once it has dropped ChannelLock, which it holds here.
+
+--*/
 {
-	KIRQL oldIrql;
-	KeAcquireSpinLock(&TrData->SpinLock, &oldIrql);
+	ULONG count = 0;
 
-	__try
+	for (int i = 0; i < ChannelPriorityCount && count < 8; i++)
 	{
-		while (1)
+		INT channel;
+
+		while (count < 8 &&
+			!IsListEmpty(&Data->ChannelWaiters[i]) &&
+			Controller_ClaimChannel(Data, (CHANNEL_PRIORITY)i, &channel))
 		{
-			switch (TrData->StateMachine.State)
-			{
-			case CHSM_Idle:
-				return;
-			case CHSM_ControlSetup:
-			{
-				KdPrint((__FUNCTION__ ": CHSM_ControlSetup %02x %02x %02x %02x %02x %02x %02x %02x\n",
-					TrData->StateMachine.Urb->u.SetupPacket[0],
-					TrData->StateMachine.Urb->u.SetupPacket[1],
-					TrData->StateMachine.Urb->u.SetupPacket[2],
-					TrData->StateMachine.Urb->u.SetupPacket[3],
-					TrData->StateMachine.Urb->u.SetupPacket[4],
-					TrData->StateMachine.Urb->u.SetupPacket[5],
-					TrData->StateMachine.Urb->u.SetupPacket[6],
-					TrData->StateMachine.Urb->u.SetupPacket[7]
-					));
+			PTR_DATA granted = CONTAINING_RECORD(RemoveHeadList(&Data->ChannelWaiters[i]), TR_DATA, ChannelWaitLink);
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = DWC_HCTSIZ_SETUP;
-				TrData->TrStateMachine.Buffer = TrData->StateMachine.Urb->u.SetupPacket;
-				TrData->TrStateMachine.Length = 8;
-				TrData->TrStateMachine.In = FALSE;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+			granted->ChannelWaiting = FALSE;
+			granted->GrantedChannel = channel;
 
-				TrData->StateMachine.State = CHSM_ControlSetupWait;
-				break;
-			}
-			case CHSM_ControlSetupWait:
-				KdPrint((__FUNCTION__ ": CHSM_ControlSetupWait\n"));
+			Granted[count++] = granted;
+		}
 
-				TR_RunTrSm(TrData);
+		// a lower class never overtakes a higher one still waiting
+		if (!IsListEmpty(&Data->ChannelWaiters[i]))
+		{
+			break;
+		}
+	}
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
-				{
-					return;
-				}
+	return count;
+}
 
-				TrData->StateMachine.State = CHSM_ControlSetupDone;
+NTSTATUS
+Controller_AllocateChannel(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTR_DATA TrData,
+	_Out_ INT* Channel
+)
+/*++
 
-				break;
-			case CHSM_ControlSetupDone:
-				KdPrint((__FUNCTION__ ": CHSM_ControlSetupDone\n"));
+Routine Description:
 
-				if (TrData->StateMachine.Urb->TransferBufferLength)
-				{
-					TrData->StateMachine.State = CHSM_ControlData;
-				}
-				else
-				{
-					TrData->StateMachine.State = CHSM_ControlStatus;
-				}
-				break;
-			case CHSM_ControlData:
-			{
-				// in?
-				INT in = TrData->StateMachine.Urb->TransferFlags & USBD_TRANSFER_DIRECTION_IN;
+Gets TrData a channel. Returns STATUS_PENDING when it has to wait: the
+transfer is then queued in its priority class, and Controller_ReleaseChannel
+hands it a channel through GrantedChannel and reruns its state machine.
 
-				KdPrint((__FUNCTION__ ": CHSM_ControlData\n"));
+A transfer never overtakes one waiting in the same or a higher class.
 
-				PVOID transferBuffer = TrData->StateMachine.Urb->TransferBuffer;
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	CHANNEL_PRIORITY priority = TrData->EndpointHandle->Priority;
+	NTSTATUS status = STATUS_PENDING;
+	BOOLEAN reconfigure = FALSE;
+	ULONG periodicWords = 0;
+	KIRQL oldIrql;
 
-				if (TrData->StateMachine.Urb->TransferBufferMDL)
-				{
-					transferBuffer = MmGetSystemAddressForMdlSafe(TrData->StateMachine.Urb->TransferBufferMDL, HighPagePriority);
-				}
+	KeAcquireSpinLock(&data->ChannelLock, &oldIrql);
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = DWC_HCTSIZ_DATA1;
-				TrData->TrStateMachine.Buffer = transferBuffer;
-				TrData->TrStateMachine.Length = TrData->StateMachine.Urb->TransferBufferLength;
-				TrData->TrStateMachine.In = in;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+	if (TrData->GrantedChannel >= 0)
+	{
+		*Channel = TrData->GrantedChannel;
+		TrData->GrantedChannel = -1;
 
-				TrData->StateMachine.State = CHSM_ControlDataWait;
-				break;
-			}
-			case CHSM_ControlDataWait:
-				KdPrint((__FUNCTION__ ": CHSM_ControlDataWait\n"));
+		status = STATUS_SUCCESS;
+	}
+	else if (!TrData->ChannelWaiting)
+	{
+		BOOLEAN queued = FALSE;
 
-				TR_RunTrSm(TrData);
+		for (int i = 0; i <= (int)priority; i++)
+		{
+			if (!IsListEmpty(&data->ChannelWaiters[i]))
+			{
+				queued = TRUE;
+			}
+		}
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
-				{
-					return;
-				}
+		//
+		// Take the partition's input here, program it once the lock is
+		// dropped; the flushes may take a while. FifoBusy holds every
+		// transfer back meanwhile, this one included.
+		//
+		if (data->FifoDirty && data->ChannelMask == 0 && !data->FifoBusy)
+		{
+			data->FifoDirty = FALSE;
+			data->FifoBusy = TRUE;
+			periodicWords = data->PeriodicFifoWords;
+			reconfigure = TRUE;
+		}
 
-				TrData->StateMachine.State = CHSM_ControlDataDone;
+		if (!queued && Controller_ClaimChannel(data, priority, Channel))
+		{
+			status = STATUS_SUCCESS;
+		}
+		else
+		{
+			InsertTailList(&data->ChannelWaiters[priority], &TrData->ChannelWaitLink);
+			TrData->ChannelWaiting = TRUE;
+		}
+	}
 
-				break;
-			case CHSM_ControlDataDone:
-				KdPrint((__FUNCTION__ ": CHSM_ControlDataDone\n"));
+	KeReleaseSpinLock(&data->ChannelLock, oldIrql);
 
-				TrData->StateMachine.State = CHSM_ControlStatus;
-				break;
-			case CHSM_ControlStatus:
-			{
-				// in?
-				INT in = TrData->StateMachine.Urb->TransferFlags & USBD_TRANSFER_DIRECTION_IN;
+	if (reconfigure)
+	{
+		PTR_DATA granted[8];
+		ULONG count;
 
-				KdPrint((__FUNCTION__ ": CHSM_ControlStatus\n"));
+		Controller_ConfigureFifos(UcxController, periodicWords);
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = DWC_HCTSIZ_DATA1;
-				TrData->TrStateMachine.Buffer = TrData->StatusBuffer;
-				TrData->TrStateMachine.Length = 0;
-				TrData->TrStateMachine.In = (TrData->StateMachine.Urb->TransferBufferLength) ? !in : TRUE;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+		KeAcquireSpinLock(&data->ChannelLock, &oldIrql);
 
-				TrData->StateMachine.State = CHSM_ControlStatusWait;
-				break;
-			}
-			case CHSM_ControlStatusWait:
-				KdPrint((__FUNCTION__ ": CHSM_ControlStatusWait\n"));
+		data->FifoBusy = FALSE;
+		count = Controller_GrantWaiters(data, granted);
 
-				TR_RunTrSm(TrData);
+		KeReleaseSpinLock(&data->ChannelLock, oldIrql);
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
-				{
-					return;
-				}
+		for (ULONG i = 0; i < count; i++)
+		{
+			Controller_InvokeTrSm(UcxController, granted[i]);
+		}
 
-				TrData->StateMachine.State = CHSM_ControlStatusDone;
+		return STATUS_PENDING;
+	}
 
-				break;
-			case CHSM_ControlStatusDone:
-			{
-				KdPrint((__FUNCTION__ ": CHSM_ControlStatusDone\n"));
+	if (status == STATUS_PENDING)
+	{
+		KdPrint((__FUNCTION__ ": No channel for class %d, waiting\n", priority));
+	}
 
-				TrData->StateMachine.State = CHSM_Idle;
+	return status;
+}
 
-				TrData->StateMachine.Urb->Hdr.Status = USBD_STATUS_SUCCESS;
-				Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
+VOID
+Controller_ReleaseChannel(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ INT Channel
+)
+/*++
 
-				WdfRequestComplete(TrData->StateMachine.Request, STATUS_SUCCESS);
-				//TrData->StateMachine.State = CHSM_ControlStatus;
-				return;
-			}
-			case CHSM_AddressSetup:
-			{
-				static USB_DEFAULT_PIPE_SETUP_PACKET setupPacket;
+Routine Description:
 
-				KdPrint((__FUNCTION__ ": CHSM_AddressSetup\n"));
+Frees a channel and passes it on to the first waiter of the highest class
+that may take one.
 
-#define USBPORT_INIT_SETUP_PACKET(s, brequest, \
-    direction, recipient, typ, wvalue, windex, wlength) \
-    {\
-    (s).bRequest = (brequest);\
-    (s).bmRequestType.Dir = (direction);\
-    (s).bmRequestType.Type = (typ);\
-    (s).bmRequestType.Recipient = (recipient);\
-    (s).bmRequestType.Reserved = 0;\
-    (s).wValue.W = (wvalue);\
-    (s).wIndex.W = (windex);\
-    (s).wLength = (wlength);\
-    }
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	PTR_DATA granted[8];
+	ULONG count;
+	KIRQL oldIrql;
 
-				USBPORT_INIT_SETUP_PACKET(setupPacket,
-					USB_REQUEST_SET_ADDRESS, // bRequest
-					BMREQUEST_HOST_TO_DEVICE, // Dir
-					BMREQUEST_TO_DEVICE, // Recipient
-					BMREQUEST_STANDARD, // Type
-					TrData->StateMachine.Address, // wValue
-					0, // wIndex
-					0)
+	KeAcquireSpinLock(&data->ChannelLock, &oldIrql);
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = DWC_HCTSIZ_SETUP;
-				TrData->TrStateMachine.Buffer = &setupPacket;
-				TrData->TrStateMachine.Length = 8;
-				TrData->TrStateMachine.In = FALSE;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+	InterlockedAnd8(&data->ChannelMask, ~(1 << Channel));
 
-				TrData->StateMachine.Urb = FALSE;
+	count = Controller_GrantWaiters(data, granted);
 
-				TrData->StateMachine.State = CHSM_AddressSetupWait;
-				break;
-			}
-			case CHSM_AddressSetupWait:
-				KdPrint((__FUNCTION__ ": CHSM_AddressSetupWait\n"));
+	KeReleaseSpinLock(&data->ChannelLock, oldIrql);
 
-				TR_RunTrSm(TrData);
+	for (ULONG i = 0; i < count; i++)
+	{
+		Controller_InvokeTrSm(UcxController, granted[i]);
+	}
+}
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
-				{
-					return;
-				}
+VOID
+Controller_CancelChannelWait(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PTR_DATA TrData
+)
+/*++
 
-				TrData->StateMachine.State = CHSM_AddressSetupDone;
+Routine Description:
 
-				break;
-			case CHSM_AddressSetupDone:
-				KdPrint((__FUNCTION__ ": CHSM_AddressSetupDone\n"));
+Takes TrData off the channel wait queue, giving back a channel it may
+already have been granted.
 
-				TrData->StateMachine.State = CHSM_AddressStatus;
-				break;
-			case CHSM_AddressStatus:
-				KdPrint((__FUNCTION__ ": CHSM_AddressStatus\n"));
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	INT channel;
+	KIRQL oldIrql;
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = DWC_HCTSIZ_DATA1;
-				TrData->TrStateMachine.Buffer = TrData->StatusBuffer;
-				TrData->TrStateMachine.Length = 0;
-				TrData->TrStateMachine.In = TRUE;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+	KeAcquireSpinLock(&data->ChannelLock, &oldIrql);
 
-				TrData->StateMachine.State = CHSM_AddressStatusWait;
-				break;
-			case CHSM_AddressStatusWait:
-				KdPrint((__FUNCTION__ ": CHSM_AddressStatusWait\n"));
+	if (TrData->ChannelWaiting)
+	{
+		RemoveEntryList(&TrData->ChannelWaitLink);
+		TrData->ChannelWaiting = FALSE;
+	}
 
-				TR_RunTrSm(TrData);
+	channel = TrData->GrantedChannel;
+	TrData->GrantedChannel = -1;
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
-				{
-					return;
-				}
+	KeReleaseSpinLock(&data->ChannelLock, oldIrql);
 
-				TrData->StateMachine.State = CHSM_AddressStatusDone;
+	if (channel >= 0)
+	{
+		Controller_ReleaseChannel(UcxController, channel);
+	}
+}
 
-				break;
-			case CHSM_AddressStatusDone:
-			{
-				KdPrint((__FUNCTION__ ": CHSM_AddressStatusDone\n"));
+BOOLEAN
+UsbDevice_GetTt(
+	PUSBDEVICE_DATA UsbDevice,
+	INT* TtHub,
+	INT* TtPort,
+	INT* TtId
+)
+/*++
 
-				TrData->EndpointHandle->UsbDeviceHandle->Address = TrData->StateMachine.Address;
+Routine Description:
 
-				TrData->StateMachine.State = CHSM_Idle;
-				Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
+Works out which transaction translator a full/low speed device sits
+behind. Returns FALSE for high speed devices and anything without a TT.
 
-				WdfRequestComplete(TrData->StateMachine.Request, STATUS_SUCCESS);
-				//TrData->StateMachine.State = CHSM_ControlStatus;
-				return;
-			}
-			case CHSM_InterruptOrBulkData:
-			{
-				// in?
-				INT in = TrData->StateMachine.Urb->TransferFlags & USBD_TRANSFER_DIRECTION_IN;
+TtPort is the hub port the device hangs off, as it goes into hcsplt.
+TtId names the TT itself: the port on a multi-TT hub, and 0 for every
+port of a single-TT hub, since those all share one.
 
-				KdPrint((__FUNCTION__ ": CHSM_InterruptOrBulkData\n"));
+--*/
+{
+	PUCXUSBDEVICE_INFO usbDeviceInfo = &UsbDevice->UsbDeviceInfo;
 
-				PVOID transferBuffer = TrData->StateMachine.Urb->TransferBuffer;
+	if (usbDeviceInfo->DeviceSpeed != UsbLowSpeed &&
+		usbDeviceInfo->DeviceSpeed != UsbFullSpeed)
+	{
+		return FALSE;
+	}
 
-				if (TrData->StateMachine.Urb->TransferBufferMDL)
+	if (usbDeviceInfo->TtHub == NULL)
+	{
+		KdPrint(("TtHub is NULL?\n"));
+		return FALSE;
+	}
+
+	PUSBDEVICE_DATA ttHubData = GetUsbDeviceData(usbDeviceInfo->TtHub);
+	UINT8 translatorPortNumber = 0;
+
+	if (usbDeviceInfo->PortPath.TTHubDepth != 0)
+	{
+		translatorPortNumber =
+			(UINT8)usbDeviceInfo->PortPath.PortPath[usbDeviceInfo->PortPath.TTHubDepth];
+	}
+	else
+	{
+		KdPrint(("no translator port?\n"));
+	}
+
+	*TtHub = (UINT8)ttHubData->Address;
+	*TtPort = translatorPortNumber;
+	*TtId = ttHubData->NumberOfTTs > 1 ? translatorPortNumber : 0;
+
+	return TRUE;
+}
+
+NTSTATUS
+Controller_TtReserve(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PENDPOINT_DATA Endpoint
+)
+/*++
+
+Routine Description:
+
+Admits a full/low speed interrupt endpoint against the periodic budget of
+its TT, see PeriodicBudget_TtReserve. The start-split goes out in the
+microframe before the first one booked (USB 2.0 11.18.4). Every endpoint
+is accounted as if it ran each frame, whatever its bInterval.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	INT ttHub;
+	INT ttPort;
+	INT ttId;
+	TT_PLACEMENT placement;
+	KIRQL oldIrql;
+	NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+	Endpoint->TtIndex = -1;
+
+	if (Endpoint->Type != EndpointType_Interrupt ||
+		!UsbDevice_GetTt(Endpoint->UsbDeviceHandle, &ttHub, &ttPort, &ttId))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	ULONG cost = PeriodicBudget_TtCost(Endpoint->MaxPacketSize,
+		Endpoint->UsbDeviceHandle->UsbDeviceInfo.DeviceSpeed == UsbLowSpeed);
+
+	KeAcquireSpinLock(&data->TtLock, &oldIrql);
+
+	if (PeriodicBudget_TtReserve(data->Tts, ttHub, ttId, cost, &placement))
+	{
+		Endpoint->TtIndex = placement.Index;
+		Endpoint->TtFirstMicroframe = (UCHAR)placement.First;
+		Endpoint->TtSpan = (UCHAR)placement.Span;
+		Endpoint->TtShare = placement.Share;
+		Endpoint->TtStartMicroframe = (UCHAR)((placement.First - 1) & 7);
+
+		status = STATUS_SUCCESS;
+	}
+
+	KeReleaseSpinLock(&data->TtLock, oldIrql);
+
+	KdPrint((__FUNCTION__ ": hub %d port %d (tt %d) cost %d -> slot %d, start-split in microframe %d (%x)\n",
+		ttHub, ttPort, ttId, cost, Endpoint->TtIndex, Endpoint->TtStartMicroframe, status));
+
+	return status;
+}
+
+NTSTATUS
+Controller_HsReserve(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PENDPOINT_DATA Endpoint
+)
+/*++
+
+Routine Description:
+
+Admits a high speed interrupt endpoint against the periodic share of the
+microframe, counting every transaction of a high bandwidth endpoint. Like
+the TT budget, every endpoint is accounted as if it ran each microframe.
+
+--*/
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	KIRQL oldIrql;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	Endpoint->HsCost = 0;
+
+	if (Endpoint->Type != EndpointType_Interrupt ||
+		Endpoint->UsbDeviceHandle->UsbDeviceInfo.DeviceSpeed != UsbHighSpeed)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	ULONG cost = PeriodicBudget_HsCost(Endpoint->MaxPacketSize, Endpoint->Mult);
+
+	KeAcquireSpinLock(&data->TtLock, &oldIrql);
+
+	if (PeriodicBudget_HsReserve(&data->HsPeriodicAllocated, cost))
+	{
+		Endpoint->HsCost = (USHORT)cost;
+	}
+	else
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	KeReleaseSpinLock(&data->TtLock, oldIrql);
+
+	KdPrint((__FUNCTION__ ": mps %d x%d cost %d, %d in use (%x)\n",
+		Endpoint->MaxPacketSize, Endpoint->Mult, cost, data->HsPeriodicAllocated, status));
+
+	return status;
+}
+
+VOID
+Controller_HsRelease(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PENDPOINT_DATA Endpoint
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	KIRQL oldIrql;
+
+	if (Endpoint->HsCost == 0)
+	{
+		return;
+	}
+
+	KeAcquireSpinLock(&data->TtLock, &oldIrql);
+	data->HsPeriodicAllocated -= Endpoint->HsCost;
+	KeReleaseSpinLock(&data->TtLock, oldIrql);
+
+	Endpoint->HsCost = 0;
+}
+
+VOID
+Controller_TtRelease(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ PENDPOINT_DATA Endpoint
+)
+{
+	PCONTROLLER_DATA data = ControllerGetData(UcxController);
+	KIRQL oldIrql;
+
+	if (Endpoint->TtIndex < 0)
+	{
+		return;
+	}
+
+	KeAcquireSpinLock(&data->TtLock, &oldIrql);
+
+	PeriodicBudget_TtRelease(&data->Tts[Endpoint->TtIndex],
+		Endpoint->TtFirstMicroframe, Endpoint->TtSpan, Endpoint->TtShare);
+
+	KeReleaseSpinLock(&data->TtLock, oldIrql);
+
+	Endpoint->TtIndex = -1;
+}
+
+VOID
+TR_RunTrSm(
+	PTR_DATA TrData
+);
+
+VOID
+Controller_RunCHSM(
+	PVOID Context
+);
+
+BOOLEAN
+TR_PresentNext(
+	PTR_DATA TrData
+);
+
+BOOLEAN
+TR_SubmitRingPush(
+	PTR_DATA TrData,
+	PCHSM_DATA Data
+)
+{
+	ULONG slot;
+
+	if (!SubmitRing_Reserve(&TrData->SubmitRing, &slot))
+	{
+		return FALSE;
+	}
+
+	TrData->SubmitSlots[slot] = *Data;
+
+	SubmitRing_Publish(&TrData->SubmitRing, slot);
+
+	return TRUE;
+}
+
+BOOLEAN
+TR_SubmitRingPop(
+	PTR_DATA TrData,
+	PCHSM_DATA Data
+)
+{
+	ULONG slot;
+
+	if (!SubmitRing_Peek(&TrData->SubmitRing, &slot))
+	{
+		return FALSE;
+	}
+
+	*Data = TrData->SubmitSlots[slot];
+
+	SubmitRing_Release(&TrData->SubmitRing, slot);
+
+	return TRUE;
+}
+
+UINT8
+TR_StartPid(
+	PENDPOINT_DATA Endpoint,
+	BOOLEAN In
+)
+/*++
+
+Routine Description:
+
+The PID a bulk or interrupt transfer starts with. High bandwidth PID
+sequencing (USB 2.0 5.9.2) is for isochronous endpoints only: IN starts
+from DATA1 or DATA2 depending on the transaction count and counts down, OUT
+sends MDATA up to the last transaction. High bandwidth interrupt endpoints
+toggle DATA0/DATA1 like any other.
+
+--*/
+{
+	if (Endpoint->Type == EndpointType_Isoch && Endpoint->Mult > 1)
+	{
+		if (In)
+		{
+			return (Endpoint->Mult == 2) ? DWC_HCTSIZ_DATA1 : DWC_HCTSIZ_DATA2;
+		}
+
+		return DWC_HCTSIZ_MDATA;
+	}
+
+	return (In) ? Endpoint->InToggle : Endpoint->OutToggle;
+}
+
+VOID
+TR_BuildStages(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Lays out the stages of the transfer just popped, from the description of
+its kind and the URB (see TR_LayoutStages), and gives them their buffers
+and PIDs.
+
+--*/
+{
+	PTRANSFER_URB urb = TrData->StateMachine.Urb;
+	TR_STAGE_LAYOUT layout[TR_MAX_STAGES];
+
+	ULONG count = TR_LayoutStages(TrData->StateMachine.Kind,
+		urb != NULL && (urb->TransferFlags & USBD_TRANSFER_DIRECTION_IN) != 0,
+		(urb != NULL) ? urb->TransferBufferLength : 0,
+		TrData->EndpointHandle->MaxPacketSize,
+		urb != NULL && (urb->TransferFlags & USBD_SHORT_TRANSFER_OK) != 0,
+		layout);
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		PTR_STAGE stage = &TrData->Stages[i];
+
+		stage->In = layout[i].In;
+		stage->Zlp = layout[i].Zlp;
+		stage->ReportLength = layout[i].ReportLength;
+		stage->Length = layout[i].Length;
+
+		switch (layout[i].Buffer)
+		{
+		case StageBufferSetup:
+			// requests the driver makes itself carry no URB
+			stage->Buffer = (urb != NULL) ? (PVOID)urb->u.SetupPacket : &TrData->StateMachine.RequestData->SetupPacket;
+			break;
+		case StageBufferTransfer:
+			stage->Buffer = TrData->StateMachine.RequestData->TransferBuffer;
+			break;
+		case StageBufferStatus:
+			stage->Buffer = TrData->StatusBuffer;
+			break;
+		}
+
+		switch (layout[i].Pid)
+		{
+		case StagePidSetup:
+			stage->Pid = DWC_HCTSIZ_SETUP;
+			break;
+		case StagePidData1:
+			stage->Pid = DWC_HCTSIZ_DATA1;
+			break;
+		case StagePidToggle:
+			stage->Pid = TR_StartPid(TrData->EndpointHandle, stage->In);
+			break;
+		}
+	}
+
+	TrData->StageCount = (INT)count;
+	TrData->Stage = 0;
+}
+
+VOID
+ReviveTrSm(
+	PTR_DATA TrData
+);
+
+VOID
+TR_DetachChannel(
+	PTR_DATA TrData
+);
+
+VOID
+TR_ArmStage(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Loads the current stage into the transfer state machine. The first stage
+goes through TRSM_Init, which programs the channel for the device and
+endpoint. Later stages of a non-split transfer reuse that
+programming as is, only the direction changes, so they go straight to
+TRSM_Transferring. Split transfers give up the TT between stages and
+go back through TRSM_Init to take it again. Either way the channel stays
+attached to the transfer until its last stage is done.
+
+--*/
+{
+	PTR_STAGE stage = &TrData->Stages[TrData->Stage];
+
+	TrData->TrStateMachine.Pid = stage->Pid;
+	TrData->TrStateMachine.Buffer = stage->Buffer;
+	TrData->TrStateMachine.Length = stage->Length;
+	TrData->TrStateMachine.In = stage->In;
+	TrData->TrStateMachine.ZlpPending = stage->Zlp;
+	TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+
+	if (TrData->Stage == 0)
+	{
+		TrData->TrStateMachine.State = TRSM_Init;
+		return;
+	}
+
+	if (TrData->TrStateMachine.DoSplit)
+	{
+		ReviveTrSm(TrData);
+
+		TrData->TrStateMachine.State = TRSM_Init;
+		return;
+	}
+
+	PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
+
+	hcchar_data_t hcchar;
+
+	// hcchar itself is written when the channel is enabled
+	hcchar.d32 = controllerData->ChHcchar[TrData->TrStateMachine.Channel];
+	hcchar.b.epdir = stage->In;
+	controllerData->ChHcchar[TrData->TrStateMachine.Channel] = hcchar.d32;
+
+	TrData->TrStateMachine.Done = 0;
+	TrData->TrStateMachine.State = TRSM_Transferring;
+}
+
+VOID
+Controller_ReviveTt(
+	PCONTROLLER_DATA ControllerData,
+	INT TtHub,
+	INT TtId
+);
+
+VOID
+TR_ClearTtDone(
+	PTR_DATA HubTrData,
+	PUSB_DEFAULT_PIPE_SETUP_PACKET SetupPacket
+)
+/*++
+
+Routine Description:
+
+Releases the TT a CLEAR_TT_BUFFER request held, once it is done with or
+could not be sent. HubTrData is the hub's default endpoint.
+
+--*/
+{
+	PUSBDEVICE_DATA hubData = HubTrData->EndpointHandle->UsbDeviceHandle;
+	PCONTROLLER_DATA controllerData = hubData->ControllerData;
+	INT hub = (INT)hubData->Address;
+	INT ttId = hubData->NumberOfTTs > 1 ? SetupPacket->wIndex.W : 0;
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&controllerData->TtLock, &oldIrql);
+
+	for (int i = 0; i < CONTROLLER_MAX_TT_CLEARS; i++)
+	{
+		if (controllerData->TtClears[i].Hub == hub &&
+			controllerData->TtClears[i].TtId == ttId)
+		{
+			controllerData->TtClears[i].Hub = 0;
+			controllerData->TtClears[i].TtId = 0;
+			break;
+		}
+	}
+
+	KeReleaseSpinLock(&controllerData->TtLock, oldIrql);
+
+	Controller_ReviveTt(controllerData, hub, ttId);
+}
+
+VOID
+TR_CompleteRequest(
+	PTR_DATA TrData,
+	NTSTATUS Status
+)
+{
+	WDFREQUEST request = TrData->StateMachine.Request;
+
+	Controller_DisarmTimeout(TrData->EndpointHandle->UsbDeviceHandle->UcxController, &TrData->TimeoutEntry);
+	TrData->TimeoutCookie = 0;
+
+	if (TrData->StateMachine.Kind->Flags & TR_KIND_CLEAR_TT)
+	{
+		TR_ClearTtDone(TrData, &TrData->StateMachine.RequestData->SetupPacket);
+	}
+
+	// the transfer buffer is mapped once per request, in TR_Push, however often it ran
+	NT_ASSERT(TrData->StateMachine.RequestData->MappingCount ==
+		((TrData->StateMachine.Urb != NULL && TrData->StateMachine.Urb->TransferBufferMDL != NULL) ? 1 : 0));
+
+	Controller_ReleaseRequestData(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.RequestData);
+
+	TrData->StateMachine.RequestData = NULL;
+
+	// the driver's own requests have no WDFREQUEST
+	if (request != NULL)
+	{
+		WdfRequestComplete(request, Status);
+	}
+}
+
+VOID
+TR_SaveToggle(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Writes the data toggle the channel halted with back to the endpoint.
+hctsiz.pid only advances on packets the device acknowledged, so this is
+right after a NAK, an error or a partial transfer just as much as after
+a complete one, and for however many transactions a high bandwidth
+interrupt endpoint ran. Control endpoints run their own toggle per stage,
+and isochronous endpoints have none.
+
+--*/
+{
+	if (TrData->EndpointHandle->Type == EndpointType_Control ||
+		TrData->EndpointHandle->Type == EndpointType_Isoch)
+	{
+		return;
+	}
+
+	if (TrData->TrStateMachine.In)
+	{
+		TrData->EndpointHandle->InToggle = TrData->TrStateMachine.Pid;
+	}
+	else
+	{
+		TrData->EndpointHandle->OutToggle = TrData->TrStateMachine.Pid;
+	}
+}
+
+ULONG
+TR_ActualLength(
+	PTR_DATA TrData,
+	PVOID Base
+)
+/*++
+
+Routine Description:
+
+Bytes moved by the transfer that started at Base. A NAK retry rebases
+Buffer past the bytes already moved, so both parts count.
+
+--*/
+{
+	return (ULONG)((PCHAR)TrData->TrStateMachine.Buffer - (PCHAR)Base) + TrData->TrStateMachine.Done;
+}
+
+VOID
+Endpoint_ResetToggle(
+	PENDPOINT_DATA Endpoint
+)
+{
+	Endpoint->InToggle = DWC_HCTSIZ_DATA0;
+	Endpoint->OutToggle = DWC_HCTSIZ_DATA0;
+	Endpoint->PingState = FALSE;
+}
+
+BOOLEAN
+TR_UsesPing(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+PING flow control applies to high speed bulk and control OUT, sent
+directly rather than as splits through a TT. A SETUP is never preceded
+by a PING (USB 2.0 8.5.1), so the setup stage of a control transfer
+neither uses nor changes the ping state.
+
+--*/
+{
+	return !TrData->TrStateMachine.In &&
+		TrData->Stages[TrData->Stage].Pid != DWC_HCTSIZ_SETUP &&
+		!TrData->TrStateMachine.DoSplit &&
+		TrData->EndpointHandle->UsbDeviceHandle->UsbDeviceInfo.DeviceSpeed == UsbHighSpeed &&
+		(TrData->EndpointHandle->Type == EndpointType_Bulk ||
+		 TrData->EndpointHandle->Type == EndpointType_Control);
+}
+
+VOID
+TR_StepChSm(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Runs the transfer kind's stages, as laid out by TR_BuildStages, one after
+the other on the channel. Nothing here depends on the kind of transfer
+beyond what its description says.
+
+--*/
+{
+	while (1)
+	{
+		switch (TrData->StateMachine.State)
+		{
+		case CHSM_Idle:
+		{
+			if (!TR_SubmitRingPop(TrData, &TrData->StateMachine) &&
+				(!TR_PresentNext(TrData) || !TR_SubmitRingPop(TrData, &TrData->StateMachine)))
+			{
+				return;
+			}
+
+			if (TrData->AbortPending)
+			{
+				if (TrData->StateMachine.Urb)
 				{
-					transferBuffer = MmGetSystemAddressForMdlSafe(TrData->StateMachine.Urb->TransferBufferMDL, HighPagePriority);
+					TrData->StateMachine.Urb->Hdr.Status = USBD_STATUS_CANCELED;
 				}
 
-				TrData->TrStateMachine.State = TRSM_Init;
-				TrData->TrStateMachine.Pid = (in) ? TrData->EndpointHandle->InToggle : TrData->EndpointHandle->OutToggle;
-				TrData->TrStateMachine.Buffer = transferBuffer;
-				TrData->TrStateMachine.Length = TrData->StateMachine.Urb->TransferBufferLength;
-				TrData->TrStateMachine.In = in;
-				TrData->TrStateMachine.Channel = TrData->StateMachine.Channel;
+				TrData->StateMachine.State = CHSM_Idle;
 
-				TrData->StateMachine.State = CHSM_InterruptOrBulkDataWait;
+				TR_CompleteRequest(TrData, STATUS_CANCELLED);
 				break;
 			}
-			case CHSM_InterruptOrBulkDataWait:
-				KdPrint((__FUNCTION__ ": CHSM_InterruptOrBulkDataWait\n"));
 
-				TR_RunTrSm(TrData);
+			// the URB timeout covers the wait for a channel too
+			if (TrData->StateMachine.Urb != NULL && TrData->StateMachine.Urb->Timeout != 0)
+			{
+				TrData->TimeoutCookie = Controller_ArmTimeout(TrData->EndpointHandle->UsbDeviceHandle->UcxController,
+					&TrData->TimeoutEntry, TrData->StateMachine.Urb->Timeout);
+			}
+
+			TrData->StateMachine.State = CHSM_ChannelWait;
+			break;
+		}
+		case CHSM_ChannelWait:
+		{
+			INT channel;
+			NTSTATUS status = Controller_AllocateChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData, &channel);
+
+			if (status == STATUS_PENDING)
+			{
+				return;
+			}
+
+			TrData->StateMachine.Channel = channel;
+
+			Controller_SetChannelCallback(TrData->EndpointHandle->UsbDeviceHandle->UcxController, channel, Controller_RunCHSM, TrData);
+
+			Controller_SetChannelTarget(TrData->EndpointHandle->UsbDeviceHandle->UcxController, channel,
+				TrData->StateMachine.Urb != NULL ? TrData->StateMachine.Urb->UrbData.ProcessorNumber : KeGetCurrentProcessorNumberEx(NULL));
+
+			TR_BuildStages(TrData);
+			TR_ArmStage(TrData);
+
+			TrData->StateMachine.State = CHSM_Stage;
+			break;
+		}
+		case CHSM_Stage:
+		{
+			TR_RunTrSm(TrData);
+
+			if (TrData->TrStateMachine.State != TRSM_Done)
+			{
+				return;
+			}
+
+			PTR_STAGE stage = &TrData->Stages[TrData->Stage];
+
+			if (stage->ReportLength)
+			{
+				TrData->StateMachine.Urb->TransferBufferLength = TR_ActualLength(TrData, stage->Buffer);
+			}
+
+			if (++TrData->Stage < TrData->StageCount)
+			{
+				// straight on to the next stage from this same pass
+				TR_ArmStage(TrData);
+				break;
+			}
+
+			if (TrData->StateMachine.Kind->Flags & TR_KIND_SET_ADDRESS)
+			{
+				TrData->EndpointHandle->UsbDeviceHandle->Address = TrData->StateMachine.RequestData->SetupPacket.wValue.W;
+			}
+
+			TrData->StateMachine.State = CHSM_Idle;
 
-				if (TrData->TrStateMachine.State != TRSM_Done)
+			TR_DetachChannel(TrData);
+
+			Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
+
+			if (TrData->StateMachine.Urb)
+			{
+				TrData->StateMachine.Urb->Hdr.Status = USBD_STATUS_SUCCESS;
+			}
+
+			TR_CompleteRequest(TrData, STATUS_SUCCESS);
+			return;
+		}
+		}
+	}
+}
+
+VOID
+TR_ClearTtBuffer(
+	PTR_DATA TrData
+);
+
+VOID
+TR_DetachChannel(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Lets go of what the transfer held on its channel once it is over, after
+its last stage or on an error or abort: channel interrupts are masked and
+cleared, the TT is given up under TtLock, which lets the next split
+waiting on it go, and the channel slot is emptied. The channel itself is
+still allocated.
+
+--*/
+{
+	int channel = TrData->TrStateMachine.Channel;
+	PCONTROLLER_DATA controllerData = TrData->EndpointHandle->UsbDeviceHandle->ControllerData;
+	dwc_otg_hc_regs_t* regs = controllerData->ChannelRegs[channel];
+
+	regs->hcintmsk = 0;
+	regs->hcint = 0xFFFFFFFF;
+
+	controllerData->ChHcintmsk[channel] = 0;
+
+	ReviveTrSm(TrData);
+
+	controllerData->ChTrDatas[channel] = NULL;
+}
+
+//
+// A channel halts by the end of the (micro)frame it is in, a full speed
+// frame at worst.
+//
+#define DWC_CHANNEL_HALT_TIMEOUT_US 1000
+
+VOID
+TR_Abort(
+	PTR_DATA TrData,
+	NTSTATUS Status,
+	USBD_STATUS UsbdStatus
+)
+/*++
+
+Routine Description:
+
+Cancels the transfer the endpoint has in flight, if any. A running channel
+is disabled and given a bounded time to halt, then everything the transfer
+held is let go right away: the resume timer, the TT, the channel slot and
+the channel itself. The request completes with the status given, which is
+how both endpoint aborts and URB timeouts end a transfer.
+
+--*/
+{
+	if (TrData->StateMachine.State == CHSM_Idle)
+	{
+		return;
+	}
+
+	if (TrData->StateMachine.State == CHSM_ChannelWait)
+	{
+		Controller_CancelChannelWait(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData);
+
+		TrData->StateMachine.State = CHSM_Idle;
+
+		if (TrData->StateMachine.Urb)
+		{
+			TrData->StateMachine.Urb->Hdr.Status = UsbdStatus;
+		}
+
+		TR_CompleteRequest(TrData, Status);
+		return;
+	}
+
+	int channel = TrData->StateMachine.Channel;
+	PCONTROLLER_DATA controllerData = TrData->EndpointHandle->UsbDeviceHandle->ControllerData;
+	dwc_otg_hc_regs_t* regs = controllerData->ChannelRegs[channel];
+
+	KdPrint((__FUNCTION__ ": aborting channel %d\n", channel));
+
+	ExCancelTimer(controllerData->ChResumeTimers[channel], NULL);
+	Controller_CancelMicroframeWait(TrData->EndpointHandle->UsbDeviceHandle->UcxController, channel);
+
+	if (TrData->TrStateMachine.State == TRSM_TransferWaiting)
+	{
+		hcchar_data_t hcchar;
+		hcint_data_t hcint;
+
+		KeMemoryBarrier();
+		_DataSynchronizationBarrier();
+
+		hcchar.d32 = regs->hcchar;
+
+		if (hcchar.b.chen)
+		{
+			hcchar.b.chdis = 1;
+			regs->hcchar = hcchar.d32;
+
+			for (int i = 0; i < DWC_CHANNEL_HALT_TIMEOUT_US; i++)
+			{
+				KeMemoryBarrier();
+				_DataSynchronizationBarrier();
+
+				hcint.d32 = regs->hcint;
+
+				if (hcint.b.chhltd)
 				{
-					return;
+					break;
 				}
 
-				TrData->StateMachine.State = CHSM_InterruptOrBulkDataDone;
+				KeStallExecutionProcessor(1);
+			}
 
-				break;
-			case CHSM_InterruptOrBulkDataDone:
+			if (!hcint.b.chhltd)
 			{
-				KdPrint((__FUNCTION__ ": CHSM_InterruptOrBulkDataDone\n"));
+				KdPrint((__FUNCTION__ ": channel %d did not halt\n", channel));
+			}
+		}
+
+		hctsiz_data_t hctsiz;
+		hctsiz.d32 = regs->hctsiz;
+
+		TrData->TrStateMachine.Pid = (UINT8)hctsiz.b.pid;
+
+		TR_SaveToggle(TrData);
+	}
+
+	//
+	// A bulk or control split cut off between its start and complete split
+	// may have left its data in the TT buffer.
+	//
+	if (TrData->TrStateMachine.DoSplit &&
+		(TrData->TrStateMachine.CompleteSplit || TrData->TrStateMachine.State == TRSM_TransferWaiting))
+	{
+		TR_ClearTtBuffer(TrData);
+	}
+
+	TR_DetachChannel(TrData);
+
+	TrData->TrStateMachine.State = TRSM_Done;
+	TrData->StateMachine.State = CHSM_Idle;
+
+	Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, channel);
+
+	if (TrData->StateMachine.Urb)
+	{
+		TrData->StateMachine.Urb->Hdr.Status = UsbdStatus;
+	}
+
+	TR_CompleteRequest(TrData, Status);
+}
+
+VOID
+TR_TimeoutExpired(
+	PVOID Context,
+	ULONG Cookie
+)
+{
+	PTR_DATA trData = (PTR_DATA)Context;
+
+	InterlockedExchange(&trData->ExpiredCookie, (LONG)Cookie);
+
+	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
+}
+
+VOID
+TR_RunChSm(
+	PTR_DATA TrData
+)
+/*++
+
+Routine Description:
+
+Runs the channel state machine of an endpoint. This is entered from the
+submission DPC, the channel interrupt DPC and the resume timers, possibly
+at the same time on different processors. Rather than serializing those
+on a lock, whoever bumps RunCount from zero becomes the runner and keeps
+going until every caller that arrived meanwhile has been accounted for.
+
+--*/
+{
+	LONG pending;
+
+	if (!RunCount_Enter(&TrData->RunCount))
+	{
+		return;
+	}
 
-				INT in = TrData->StateMachine.Urb->TransferFlags & USBD_TRANSFER_DIRECTION_IN;
+	do
+	{
+		pending = RunCount_Snapshot(&TrData->RunCount);
 
-				if (in)
-				{
-					TrData->EndpointHandle->InToggle = TrData->TrStateMachine.Pid;
-				}
-				else
-				{
-					TrData->EndpointHandle->OutToggle = TrData->TrStateMachine.Pid;
-				}
+		if (TrData->AbortPending)
+		{
+			TR_Abort(TrData, STATUS_CANCELLED, USBD_STATUS_CANCELED);
+		}
 
-				TrData->StateMachine.State = CHSM_Idle;
-				Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
+		//
+		// Only the expiry of the deadline armed last counts, an older one
+		// may have raced with its request completing.
+		//
+		LONG expired = InterlockedExchange(&TrData->ExpiredCookie, 0);
 
-				TrData->StateMachine.Urb->Hdr.Status = USBD_STATUS_SUCCESS;
-				WdfRequestComplete(TrData->StateMachine.Request, STATUS_SUCCESS);
+		if (expired != 0 &&
+			(ULONG)expired == TrData->TimeoutCookie &&
+			TrData->StateMachine.State != CHSM_Idle)
+		{
+			KdPrint((__FUNCTION__ ": URB timeout\n"));
 
-				return;
-			}
-			}
+			TR_Abort(TrData, STATUS_IO_TIMEOUT, USBD_STATUS_TIMEOUT);
 		}
-	}
-	__finally
-	{
-		KeReleaseSpinLock(&TrData->SpinLock, oldIrql);
-	}
+
+		TR_StepChSm(TrData);
+
+	} while (!RunCount_Leave(&TrData->RunCount, pending));
 }
 
 VOID
@@ -542,25 +1484,46 @@ ReviveTrSm(
 	int channel = TrData->TrStateMachine.Channel;
 
 	PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&controllerData->TtLock, &oldIrql);
 	controllerData->ChTtHubs[channel] = -1;
 	controllerData->ChTtPorts[channel] = -1;
+	KeReleaseSpinLock(&controllerData->TtLock, oldIrql);
+
+	Controller_ReviveTt(controllerData, TrData->TrStateMachine.TtHub, TrData->TrStateMachine.TtId);
+}
 
+VOID
+Controller_ReviveTt(
+	PCONTROLLER_DATA ControllerData,
+	INT TtHub,
+	INT TtId
+)
+/*++
+
+Routine Description:
+
+Lets the next channel waiting for the TT in TRSM_CheckFreePort try again.
+
+--*/
+{
 	for (int i = 0; i < 8; i++)
 	{
-		PTR_DATA chanData = controllerData->ChTrDatas[i];
+		PTR_DATA chanData = ControllerData->ChTrDatas[i];
 
 		if (chanData)
 		{
 			if (chanData->TrStateMachine.State == TRSM_CheckFreePort &&
-				chanData->TrStateMachine.TtPort == TrData->TrStateMachine.TtPort &&
-				chanData->TrStateMachine.TtHub == TrData->TrStateMachine.TtHub)
+				chanData->TrStateMachine.TtId == TtId &&
+				chanData->TrStateMachine.TtHub == TtHub)
 			{
 				KdPrint(("Reviving channel %d\n", i));
 
-				controllerData->ChResumeContexts[i] = chanData;
+				ControllerData->ChResumeContexts[i] = chanData;
 
 				ExSetTimer(
-					controllerData->ChResumeTimers[i],
+					ControllerData->ChResumeTimers[i],
 					WDF_REL_TIMEOUT_IN_US(50),
 					0,
 					NULL
@@ -583,14 +1546,13 @@ TR_RunTrSm(
 		{
 		case TRSM_Init:
 		{
-			KdPrint((__FUNCTION__ ": TRSM_Init\n"));
-
 			int max = TrData->EndpointHandle->MaxPacketSize;
 			int ep = TrData->EndpointHandle->UsbEndpointDescriptor.bEndpointAddress & USB_ENDPOINT_ADDRESS_MASK;
 			int devnum = TrData->EndpointHandle->UsbDeviceHandle->Address;
 
 			TrData->TrStateMachine.DoSplit = 0;
 			TrData->TrStateMachine.CompleteSplit = 0;
+			TrData->TrStateMachine.SplitWaits = 0;
 			TrData->TrStateMachine.Done = 0;
 			TrData->TrStateMachine.SSplitFrameNum = 0;
 
@@ -604,12 +1566,19 @@ TR_RunTrSm(
 			TrData->TrStateMachine.NumPackets = TrData->TrStateMachine.MaxXferLen / max;
 			TrData->TrStateMachine.MaxXferLen = TrData->TrStateMachine.NumPackets * max;
 
+			if (TrData->EndpointHandle->Type == EndpointType_Interrupt)
+			{
+				// a periodic channel only runs as many packets as fit one (micro)frame
+				TrData->TrStateMachine.NumPackets = TrData->EndpointHandle->Mult;
+				TrData->TrStateMachine.MaxXferLen = TrData->EndpointHandle->Mult * max;
+			}
+
 			int channel = TrData->TrStateMachine.Channel;
 
 			PCONTROLLER_DATA controllerHandle = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
 			controllerHandle->ChTrDatas[channel] = TrData;
 
-			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[channel];
+			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[channel];
 
 			hcchar_data_t hcchar;
 			hcchar.d32 = 0;
@@ -634,59 +1603,34 @@ TR_RunTrSm(
 			// TODO: set lspddev if low-speed
 			if (TrData->EndpointHandle->UsbDeviceHandle->UsbDeviceInfo.DeviceSpeed == UsbLowSpeed)
 			{
-				KdPrint(("low speed device\n"));
-
 				hcchar.b.lspddev = 1;
 			}
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
-
-			regs->hcchar = hcchar.d32;
-
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
-
-			regs->hcsplt = 0;
-
-			// TODO: init split if full/low-speed
-			PUCXUSBDEVICE_INFO usbDeviceInfo = &TrData->EndpointHandle->UsbDeviceHandle->UsbDeviceInfo;
+			// hcchar goes out together with chen in TRSM_Transferring
+			controllerHandle->ChHcchar[channel] = hcchar.d32;
 
-			if (usbDeviceInfo->DeviceSpeed == UsbLowSpeed ||
-				usbDeviceInfo->DeviceSpeed == UsbFullSpeed)
+			if (controllerHandle->ChHcsplt[channel] != 0)
 			{
-				if (usbDeviceInfo->TtHub != NULL)
-				{
-					PUSBDEVICE_DATA ttHubData = GetUsbDeviceData(usbDeviceInfo->TtHub);
-					UINT8 translatorHubAddress = (UINT8)ttHubData->Address;
-					UINT8 translatorPortNumber = 0;
-
-					if (usbDeviceInfo->PortPath.TTHubDepth != 0)
-					{
-						translatorPortNumber =
-							(UINT8)usbDeviceInfo->PortPath.PortPath[usbDeviceInfo->PortPath.TTHubDepth];
-					}
-					else
-					{
-						KdPrint(("no translator port?\n"));
-					}
+				regs->hcsplt = 0;
+				controllerHandle->ChHcsplt[channel] = 0;
+			}
 
-					TrData->TrStateMachine.DoSplit = 1;
-					TrData->TrStateMachine.NumPackets = 1;
-					TrData->TrStateMachine.MaxXferLen = max;
+			INT ttHub;
+			INT ttPort;
+			INT ttId;
 
-					KdPrint(("split transfer (hub %d, port %d)\n", translatorHubAddress, translatorPortNumber));
+			if (UsbDevice_GetTt(TrData->EndpointHandle->UsbDeviceHandle, &ttHub, &ttPort, &ttId))
+			{
+				TrData->TrStateMachine.DoSplit = 1;
+				TrData->TrStateMachine.NumPackets = 1;
+				TrData->TrStateMachine.MaxXferLen = max;
 
-					TrData->TrStateMachine.TtHub = translatorHubAddress;
-					TrData->TrStateMachine.TtPort = translatorPortNumber;
+				TrData->TrStateMachine.TtHub = ttHub;
+				TrData->TrStateMachine.TtPort = ttPort;
+				TrData->TrStateMachine.TtId = ttId;
 
-					TrData->TrStateMachine.State = TRSM_CheckFreePort;
-					break;
-				}
-				else
-				{
-					KdPrint(("TtHub is NULL?\n"));
-				}
+				TrData->TrStateMachine.State = TRSM_CheckFreePort;
+				break;
 			}
 
 			TrData->TrStateMachine.State = TRSM_Transferring;
@@ -694,16 +1638,32 @@ TR_RunTrSm(
 		}
 		case TRSM_CheckFreePort:
 		{
-			KdPrint((__FUNCTION__ ": TRSM_CheckFreePort"));
-
 			PCONTROLLER_DATA controllerHandle = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
 
+			//
+			// One split in flight per TT. ChTtPorts holds the TT id, so
+			// a single-TT hub serializes all of its ports while a multi-TT
+			// hub runs one split per port in parallel.
+			//
 			BOOLEAN foundSelf = FALSE;
+			KIRQL oldIrql;
+
+			KeAcquireSpinLock(&controllerHandle->TtLock, &oldIrql);
 
 			for (int i = 0; i < 8; i++)
 			{
 				if (controllerHandle->ChTtHubs[i] == TrData->TrStateMachine.TtHub &&
-					controllerHandle->ChTtPorts[i] == TrData->TrStateMachine.TtPort)
+					controllerHandle->ChTtPorts[i] == TrData->TrStateMachine.TtId)
+				{
+					foundSelf = TRUE;
+				}
+			}
+
+			// a TT being cleared is held until CLEAR_TT_BUFFER completes
+			for (int i = 0; i < CONTROLLER_MAX_TT_CLEARS; i++)
+			{
+				if (controllerHandle->TtClears[i].Hub == TrData->TrStateMachine.TtHub &&
+					controllerHandle->TtClears[i].TtId == TrData->TrStateMachine.TtId)
 				{
 					foundSelf = TRUE;
 				}
@@ -712,9 +1672,15 @@ TR_RunTrSm(
 			if (!foundSelf)
 			{
 				controllerHandle->ChTtHubs[TrData->TrStateMachine.Channel] = TrData->TrStateMachine.TtHub;
-				controllerHandle->ChTtPorts[TrData->TrStateMachine.Channel] = TrData->TrStateMachine.TtPort;
+				controllerHandle->ChTtPorts[TrData->TrStateMachine.Channel] = TrData->TrStateMachine.TtId;
+			}
 
-				dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[TrData->TrStateMachine.Channel];
+			KeReleaseSpinLock(&controllerHandle->TtLock, oldIrql);
+
+			if (!foundSelf)
+			{
+
+				dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[TrData->TrStateMachine.Channel];
 
 				hcsplt_data_t hcsplt;
 				hcsplt.d32 = 0;
@@ -723,13 +1689,9 @@ TR_RunTrSm(
 				hcsplt.b.hubaddr = TrData->TrStateMachine.TtHub;
 				hcsplt.b.prtaddr = TrData->TrStateMachine.TtPort;
 
-				KeMemoryBarrier();
-				_DataSynchronizationBarrier();
-
 				regs->hcsplt = hcsplt.d32;
 
-				KeMemoryBarrier();
-				_DataSynchronizationBarrier();
+				controllerHandle->ChHcsplt[TrData->TrStateMachine.Channel] = hcsplt.d32;
 
 				TrData->TrStateMachine.State = TRSM_Transferring;
 				break;
@@ -739,17 +1701,35 @@ TR_RunTrSm(
 		}
 		case TRSM_Transferring:
 		{
-			hfnum_data_t hfnum;
-			hfnum.d32 = READ_REGISTER_ULONG((volatile ULONG*)&TrData->EndpointHandle->UsbDeviceHandle->HostGlobalRegs->hfnum);
-
-			KdPrint((__FUNCTION__ ": TRSM_Transferring (done: %d, length: %d, split: %d, compsplit: %d, address: %d, frnum: %d, subfr: %d)\n",
-				TrData->TrStateMachine.Done,
-				TrData->TrStateMachine.Length,
-				TrData->TrStateMachine.DoSplit,
-				TrData->TrStateMachine.CompleteSplit,
-				TrData->EndpointHandle->UsbDeviceHandle->Address,
-				hfnum.b.frnum,
-				hfnum.b.frnum & 7));
+			if (TrData->TrStateMachine.DoSplit &&
+				!TrData->TrStateMachine.CompleteSplit &&
+				TrData->EndpointHandle->TtIndex >= 0)
+			{
+				//
+				// The start-split has to go out in the microframe the TT
+				// budget placed it in. The channel is enabled in the
+				// microframe before, resumed from its SOF, and oddfrm below
+				// holds the transaction for the next one. Should the resume
+				// come too late a frame is skipped, but after a few misses
+				// the split goes out as it is rather than starve.
+				//
+				PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
+				ULONG before = (TrData->EndpointHandle->TtStartMicroframe - 1) & 7;
+				ULONG uframe = (ULONG)(Controller_GetMicroframeCounter(TrData->EndpointHandle->UsbDeviceHandle->UcxController) & 7);
+
+				if (uframe != before && TrData->TrStateMachine.SplitWaits < TR_MAX_SPLIT_WAITS)
+				{
+					TrData->TrStateMachine.SplitWaits++;
+
+					controllerData->ChResumeContexts[TrData->TrStateMachine.Channel] = TrData;
+
+					Controller_WaitForMicroframe(TrData->EndpointHandle->UsbDeviceHandle->UcxController,
+						TrData->TrStateMachine.Channel,
+						before);
+
+					return;
+				}
+			}
 
 			ULONG max = TrData->EndpointHandle->MaxPacketSize;
 
@@ -757,7 +1737,12 @@ TR_RunTrSm(
 
 			if (TrData->TrStateMachine.XferLen > TrData->TrStateMachine.MaxXferLen)
 			{
+				//
+				// A full chunk. Later stages skip TRSM_Init, so the packet
+				// count left by the stage before cannot be relied on.
+				//
 				TrData->TrStateMachine.XferLen = TrData->TrStateMachine.MaxXferLen;
+				TrData->TrStateMachine.NumPackets = TrData->TrStateMachine.MaxXferLen / max;
 			}
 			else if (TrData->TrStateMachine.MaxXferLen > max)
 			{
@@ -773,23 +1758,44 @@ TR_RunTrSm(
 				TrData->TrStateMachine.NumPackets = 1;
 			}
 
-			int channel = TrData->TrStateMachine.Channel;
-			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[channel];
-
-			hcsplt_data_t hcsplt;
+			if (TrData->TrStateMachine.ZlpPending &&
+				!TrData->TrStateMachine.CompleteSplit &&
+				TrData->TrStateMachine.Done + TrData->TrStateMachine.XferLen == TrData->TrStateMachine.Length)
+			{
+				//
+				// Without splits the core sends the ZLP itself when the
+				// packet count runs one past the data. A split moves one
+				// packet at a time, so there the ZLP is a transaction of its
+				// own once the data is through. So it is on an interrupt
+				// pipe, whose channel may only run the transactions of one
+				// (micro)frame; the ZLP goes out in the next one.
+				//
+				if (TrData->TrStateMachine.XferLen == 0)
+				{
+					TrData->TrStateMachine.ZlpPending = FALSE;
+				}
+				else if (!TrData->TrStateMachine.DoSplit &&
+					TrData->EndpointHandle->Type != EndpointType_Interrupt)
+				{
+					TrData->TrStateMachine.NumPackets++;
+					TrData->TrStateMachine.ZlpPending = FALSE;
+				}
+			}
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
+			int channel = TrData->TrStateMachine.Channel;
+			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[channel];
 
-			hcsplt.d32 = regs->hcsplt;
+			PCONTROLLER_DATA controllerHandle = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
+			//
+			// Everything up to chen is a posted write, programmed from the
+			// shadows in CONTROLLER_DATA rather than read back from the core.
+			//
+			hcsplt_data_t hcsplt;
+			hcsplt.d32 = controllerHandle->ChHcsplt[channel];
 
 			if (TrData->TrStateMachine.CompleteSplit)
 			{
-				KdPrint(("CompleteSplit: was %x\n", hcsplt.d32));
-
 				hcsplt.b.compsplt = 1;
 			}
 			else if (TrData->TrStateMachine.DoSplit)
@@ -797,12 +1803,11 @@ TR_RunTrSm(
 				hcsplt.b.compsplt = 0;
 			}
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
-
-			regs->hcsplt = hcsplt.d32;
-
-			KeMemoryBarrier();
+			if (hcsplt.d32 != controllerHandle->ChHcsplt[channel])
+			{
+				regs->hcsplt = hcsplt.d32;
+				controllerHandle->ChHcsplt[channel] = hcsplt.d32;
+			}
 
 			// top half of transfer_chunk
 			hctsiz_data_t hctsiz;
@@ -811,13 +1816,14 @@ TR_RunTrSm(
 			hctsiz.b.pktcnt = TrData->TrStateMachine.NumPackets;
 			hctsiz.b.pid = TrData->TrStateMachine.Pid;
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
+			// the core pings first and only sends the data once the device ACKs
+			if (TR_UsesPing(TrData) && TrData->EndpointHandle->PingState)
+			{
+				hctsiz.b.dopng = 1;
+			}
 
 			regs->hctsiz = hctsiz.d32;
 
-			PCONTROLLER_DATA controllerHandle = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
-
 			if (TrData->TrStateMachine.XferLen)
 			{
 				if (!TrData->TrStateMachine.In)
@@ -825,54 +1831,44 @@ TR_RunTrSm(
 					RtlCopyMemory(controllerHandle->CommonBufferBase[TrData->TrStateMachine.Channel],
 						(PCHAR)TrData->TrStateMachine.Buffer + TrData->TrStateMachine.Done,
 						TrData->TrStateMachine.XferLen);
-
-					KeMemoryBarrier();
-					_DataSynchronizationBarrier();
 				}
 			}
 
 			WRITE_REGISTER_ULONG((volatile ULONG*)&regs->hcdma, (ULONG)controllerHandle->CommonBufferBaseLA[TrData->TrStateMachine.Channel].QuadPart);
 			regs->hcint = 0x3FFF;
 
-			_DataSynchronizationBarrier();
-
 			hcintmsk_data_t hcintmsk;
 			hcintmsk.d32 = 0;
 			hcintmsk.b.chhltd = 1;
 
-			_DataSynchronizationBarrier();
-
-			regs->hcintmsk = hcintmsk.d32;
+			if (hcintmsk.d32 != controllerHandle->ChHcintmsk[channel])
+			{
+				regs->hcintmsk = hcintmsk.d32;
+				controllerHandle->ChHcintmsk[channel] = hcintmsk.d32;
+			}
 
 			// enable interrupts for this channel
-			TrData->EndpointHandle->UsbDeviceHandle->HostGlobalRegs->haintmsk |= (1 << TrData->TrStateMachine.Channel);
+			Controller_UnmaskChannelInterrupt(TrData->EndpointHandle->UsbDeviceHandle->UcxController, channel);
 
 			hcchar_data_t hcchar;
-			hcchar.d32 = regs->hcchar;
-
-			_DataSynchronizationBarrier();
-
-			hcchar.b.multicnt = 0;
-			hcchar.b.chen = 0;
-			hcchar.b.chdis = 0;
-			hcchar.b.oddfrm = 0;
+			hcchar.d32 = controllerHandle->ChHcchar[channel];
 
-			hcchar.b.multicnt = 1;
+			hcchar.b.multicnt = TrData->EndpointHandle->Mult;
 			hcchar.b.oddfrm = 0;
+			hcchar.b.chdis = 0;
 			hcchar.b.chen = 1;
 
 			if (TrData->EndpointHandle->Type == EndpointType_Interrupt)
 			{
-				hcchar.b.oddfrm = (!(TrData->EndpointHandle->UsbDeviceHandle->HostGlobalRegs->hfnum & 1));
+				hcchar.b.oddfrm = (!(TrData->EndpointHandle->UsbDeviceHandle->ControllerData->HostGlobalRegs->hfnum & 1));
 			}
 
+			// the OUT data and all of the above must land before the channel starts
+			KeMemoryBarrier();
 			_DataSynchronizationBarrier();
 
 			regs->hcchar = hcchar.d32;
 
-			KeMemoryBarrier();
-			_DataSynchronizationBarrier();
-
 			TrData->TrStateMachine.State = TRSM_TransferWaiting;
 
 			//return;
@@ -880,10 +1876,8 @@ TR_RunTrSm(
 		}
 		case TRSM_TransferWaiting:
 		{
-			KdPrint((__FUNCTION__ ": TRSM_TransferWaiting\n"));
-
 			int channel = TrData->TrStateMachine.Channel;
-			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[channel];
+			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[channel];
 
 			hcint_data_t hcint;
 
@@ -902,10 +1896,8 @@ TR_RunTrSm(
 		}
 		case TRSM_TransferHalted:
 		{
-			KdPrint((__FUNCTION__ ": TRSM_TransferHalted\n"));
-
 			int channel = TrData->TrStateMachine.Channel;
-			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[channel];
+			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[channel];
 
 			hcint_data_t hcint;
 
@@ -922,14 +1914,9 @@ TR_RunTrSm(
 			{
 				if (hcint.b.nyet)
 				{
-					hfnum_data_t hfnum;
-
-					KeMemoryBarrier();
-					_DataSynchronizationBarrier();
+					ULONG64 frame = Controller_GetMicroframeCounter(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
 
-					hfnum.d32 = TrData->EndpointHandle->UsbDeviceHandle->HostGlobalRegs->hfnum;
-
-					if (((hfnum.b.frnum - TrData->TrStateMachine.SSplitFrameNum) & 0x3FFF) > 4)
+					if (frame - TrData->TrStateMachine.SSplitFrameNum > 4)
 					{
 						KdPrint(("Split NYET timeout, retry\n"));
 
@@ -942,8 +1929,6 @@ TR_RunTrSm(
 				}
 				else
 				{
-					KdPrint(("split complete?\n"));
-
 					TrData->TrStateMachine.CompleteSplit = 0;
 
 					//tempCompletedSplit = TRUE;
@@ -953,16 +1938,7 @@ TR_RunTrSm(
 			{
 				if (hcint.b.ack)
 				{
-					KdPrint(("Split ACK, complete it?\n"));
-
-					hfnum_data_t hfnum;
-
-					KeMemoryBarrier();
-					_DataSynchronizationBarrier();
-
-					hfnum.d32 = TrData->EndpointHandle->UsbDeviceHandle->HostGlobalRegs->hfnum;
-
-					TrData->TrStateMachine.SSplitFrameNum = hfnum.b.frnum;
+					TrData->TrStateMachine.SSplitFrameNum = Controller_GetMicroframeCounter(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
 
 					TrData->TrStateMachine.CompleteSplit = 1;
 				}
@@ -977,19 +1953,17 @@ TR_RunTrSm(
 
 			TrData->TrStateMachine.Pid = (UINT8)hctsiz.b.pid;
 
+			TR_SaveToggle(TrData);
+
 			if (hcint.b.xfercomp || hcint.b.nyet || hcint.b.ack || tempCompletedSplit)
 			{
-				if (hcint.b.xfercomp)
-				{
-					KdPrint((__FUNCTION__ ": Halted: XFERCOMP\n"));
-				}
-				else if (hcint.b.ack)
-				{
-					KdPrint((__FUNCTION__ ": Halted: ACK\n"));
-				}
-				else if (hcint.b.nyet)
+				//
+				// NYET took the packet but says the next one will likely be
+				// NAKed, so ping before it. A plain ACK ends the ping state.
+				//
+				if (TR_UsesPing(TrData))
 				{
-					KdPrint((__FUNCTION__ ": Halted: NYET\n"));
+					TrData->EndpointHandle->PingState = (BOOLEAN)hcint.b.nyet;
 				}
 
 				ULONG sub = hctsiz.b.xfersize;
@@ -1016,13 +1990,16 @@ TR_RunTrSm(
 
 				if (!TrData->TrStateMachine.CompleteSplit)
 				{
-					if (xfer_len < TrData->TrStateMachine.XferLen)
+					// OUT halts early on NYET or a PING ACK, that is not a short packet
+					if (TrData->TrStateMachine.In &&
+						xfer_len < TrData->TrStateMachine.XferLen)
 					{
 						TrData->TrStateMachine.State = TRSM_Done;
 						break;
 					}
 
-					if (TrData->TrStateMachine.Done >= TrData->TrStateMachine.Length)
+					if (TrData->TrStateMachine.Done >= TrData->TrStateMachine.Length &&
+						!TrData->TrStateMachine.ZlpPending)
 					{
 						TrData->TrStateMachine.State = TRSM_Done;
 						break;
@@ -1034,19 +2011,57 @@ TR_RunTrSm(
 			}
 			else if (hcint.b.nak || hcint.b.frmovrun)
 			{
-				KdPrint((__FUNCTION__ ": Halted: NAK/FRMOVRUN - %08x\n", hcint.d32));
+				//
+				// Packets of this chunk may have gone through before the
+				// NAK, and TR_SaveToggle has already moved the toggle past
+				// them. Count them in, IN by the bytes the core took and OUT
+				// by the packets the device ACKed.
+				//
+				ULONG moved;
+
+				if (TrData->TrStateMachine.In)
+				{
+					moved = TrData->TrStateMachine.XferLen - hctsiz.b.xfersize;
+
+					if (moved != 0)
+					{
+						PCONTROLLER_DATA controllerHandle = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
+
+						RtlCopyMemory((PCHAR)TrData->TrStateMachine.Buffer + TrData->TrStateMachine.Done,
+							controllerHandle->CommonBufferBase[TrData->TrStateMachine.Channel],
+							moved);
 
-				/*if (hcint.b.nak && TrData->TrStateMachine.Done > 0)
+						_DataSynchronizationBarrier();
+						KeMemoryBarrier();
+					}
+				}
+				else
 				{
-					TrData->TrStateMachine.State = TRSM_Done;
-					break;
-				}*/
+					moved = (TrData->TrStateMachine.NumPackets - hctsiz.b.pktcnt) * TrData->EndpointHandle->MaxPacketSize;
 
-				if (TrData->EndpointHandle->Type == EndpointType_Control)
+					if (moved > TrData->TrStateMachine.XferLen)
+					{
+						moved = TrData->TrStateMachine.XferLen;
+					}
+				}
+
+				TrData->TrStateMachine.Done += moved;
+
+				//
+				// Pick up after whatever made it through before the NAK
+				// rather than sending it again.
+				//
+				TrData->TrStateMachine.Buffer = (PCHAR)TrData->TrStateMachine.Buffer + TrData->TrStateMachine.Done;
+				TrData->TrStateMachine.Length -= TrData->TrStateMachine.Done;
+
+				// retry with a PING rather than the whole data packet
+				if (hcint.b.nak && TR_UsesPing(TrData))
 				{
-					TrData->TrStateMachine.Buffer = (PCHAR)TrData->TrStateMachine.Buffer + TrData->TrStateMachine.Done;
-					TrData->TrStateMachine.Length -= TrData->TrStateMachine.Done;
+					TrData->EndpointHandle->PingState = TRUE;
+				}
 
+				if (TrData->EndpointHandle->Type == EndpointType_Control)
+				{
 					TrData->TrStateMachine.State = TRSM_Init;
 
 					ReviveTrSm(TrData);
@@ -1077,7 +2092,7 @@ TR_RunTrSm(
 					TrData->StateMachine.State = CHSM_Idle;
 
 					Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
-					WdfRequestComplete(TrData->StateMachine.Request, STATUS_TIMEOUT);
+					TR_CompleteRequest(TrData, STATUS_TIMEOUT);
 
 					return;
 				}*/
@@ -1097,8 +2112,6 @@ TR_RunTrSm(
 					NULL
 				);
 
-				//TrData->NextStateMachine = TrData->StateMachine;
-
 				//Controller_InvokeTrSm(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData);
 
 				//break;
@@ -1114,19 +2127,15 @@ TR_RunTrSm(
 				KdPrint((__FUNCTION__ ": Halted: stall - int %08x siz %08x char %08x splt %08x\n",
 					hcint.d32,
 					hctsiz.d32,
-					TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[TrData->StateMachine.Channel]->hcchar,
-					TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[TrData->StateMachine.Channel]->hcsplt));
+					TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[TrData->StateMachine.Channel]->hcchar,
+					TrData->EndpointHandle->UsbDeviceHandle->ControllerData->ChannelRegs[TrData->StateMachine.Channel]->hcsplt));
 
 				TrData->StateMachine.State = CHSM_Idle;
 
-				PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
-				controllerData->ChTtHubs[channel] = 0;
-				controllerData->ChTtPorts[channel] = 0;
-
-				controllerData->ChTrDatas[channel] = NULL;
+				TR_DetachChannel(TrData);
 
 				Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
-				WdfRequestComplete(TrData->StateMachine.Request, STATUS_UNSUCCESSFUL);
+				TR_CompleteRequest(TrData, STATUS_UNSUCCESSFUL);
 
 				return;
 			}
@@ -1141,14 +2150,10 @@ TR_RunTrSm(
 
 				TrData->StateMachine.State = CHSM_Idle;
 
-				PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
-				controllerData->ChTtHubs[channel] = 0;
-				controllerData->ChTtPorts[channel] = 0;
-
-				controllerData->ChTrDatas[channel] = NULL;
+				TR_DetachChannel(TrData);
 
 				Controller_ReleaseChannel(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData->StateMachine.Channel);
-				WdfRequestComplete(TrData->StateMachine.Request, STATUS_UNSUCCESSFUL);
+				TR_CompleteRequest(TrData, STATUS_UNSUCCESSFUL);
 
 				return;
 			}
@@ -1157,180 +2162,288 @@ TR_RunTrSm(
 		}
 		case TRSM_Done:
 		{
-			KdPrint((__FUNCTION__ ": TRSM_Done\n"));
+			// the channel stays attached for the next stage, see TR_StepChSm
+			return;
+		}
+		}
+	}
+}
 
-			int channel = TrData->TrStateMachine.Channel;
-			dwc_otg_hc_regs_t* regs = TrData->EndpointHandle->UsbDeviceHandle->ChannelRegs[channel];
+VOID
+Controller_RunCHSM(
+	PVOID Context
+)
+{
+	TR_RunChSm((PTR_DATA)Context);
+}
+
+BOOLEAN
+TR_Push(
+	PTR_DATA TrData,
+	WDFREQUEST Request,
+	PTRANSFER_URB Urb,
+	const TR_KIND* Kind,
+	PUSB_DEFAULT_PIPE_SETUP_PACKET SetupPacket
+)
+/*++
 
-			regs->hcint = 0xFFFFFFFF;
-			regs->hcintmsk = 0;
+Routine Description:
 
-			PCONTROLLER_DATA controllerData = ControllerGetData(TrData->EndpointHandle->UsbDeviceHandle->UcxController);
+Puts a transfer on the endpoint's submit ring. Requests without a URB,
+which the driver makes on its own, bring their setup packet in
+SetupPacket; it is kept in the request's REQUEST_DATA until the transfer
+completes. Returns FALSE if the transfer was failed instead.
 
-			ReviveTrSm(TrData);
+--*/
+{
+	CHSM_DATA submit;
+	UCXCONTROLLER ucxController = TrData->EndpointHandle->UsbDeviceHandle->UcxController;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	submit.State = CHSM_ChannelWait;
+	submit.Kind = Kind;
+	submit.Urb = Urb;
+	submit.Request = Request;
+	submit.RequestData = Controller_AcquireRequestData(ucxController);
+	submit.Channel = -1;
+
+	if (submit.RequestData == NULL)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else if (SetupPacket != NULL)
+	{
+		submit.RequestData->SetupPacket = *SetupPacket;
+	}
 
-			controllerData->ChTrDatas[channel] = NULL;
+	if (NT_SUCCESS(status) && Urb != NULL)
+	{
+		//
+		// Map the transfer buffer once, here. The state machine and any
+		// retries of the transfer only ever use this address.
+		//
+		submit.RequestData->TransferBuffer = Urb->TransferBuffer;
 
-			return;
+		if (Urb->TransferBufferMDL)
+		{
+			submit.RequestData->TransferBuffer = MmGetSystemAddressForMdlSafe(Urb->TransferBufferMDL, HighPagePriority);
+			submit.RequestData->MappingCount++;
+
+			if (submit.RequestData->TransferBuffer == NULL)
+			{
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+	}
+
+	if (NT_SUCCESS(status) && !TR_SubmitRingPush(TrData, &submit))
+	{
+		KdPrint((__FUNCTION__ ": submit ring full\n"));
+
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		if (submit.RequestData != NULL)
+		{
+			Controller_ReleaseRequestData(ucxController, submit.RequestData);
+		}
+
+		if (Urb != NULL)
+		{
+			Urb->Hdr.Status = USBD_STATUS_INSUFFICIENT_RESOURCES;
 		}
+
+		if (Kind->Flags & TR_KIND_CLEAR_TT)
+		{
+			TR_ClearTtDone(TrData, SetupPacket);
+		}
+
+		if (Request != NULL)
+		{
+			WdfRequestComplete(Request, status);
 		}
+
+		return FALSE;
 	}
+
+	return TRUE;
 }
 
 VOID
-Controller_RunCHSM(
-	PVOID Context
+TR_Submit(
+	PTR_DATA TrData,
+	WDFREQUEST Request,
+	PTRANSFER_URB Urb,
+	const TR_KIND* Kind,
+	PUSB_DEFAULT_PIPE_SETUP_PACKET SetupPacket
 )
 {
-	TR_RunChSm((PTR_DATA)Context);
+	if (TR_Push(TrData, Request, Urb, Kind, SetupPacket))
+	{
+		Controller_InvokeTrSm(TrData->EndpointHandle->UsbDeviceHandle->UcxController, TrData);
+	}
 }
 
+#define USB_REQUEST_CLEAR_TT_BUFFER 0x08
+
 VOID
-Control_WdfEvtIoDefault(
-	WDFQUEUE      WdfQueue,
-	WDFREQUEST    WdfRequest
+TR_ClearTtBuffer(
+	PTR_DATA TrData
 )
 /*++
 
 Routine Description:
 
-This is the WDF callback that delivers a WDFREQUEST from client. Since the
-Control TransferRing Queue is configured as sequential, this callback can
-only arrive when the number of driver owned requests is 0.
+Sends CLEAR_TT_BUFFER (USB 2.0 11.24.2.3) to the hub whose TT carried the
+split transfer TrData just gave up on, and holds the TT meanwhile so no
+other split runs into the stale buffer. Only bulk and control transfers
+are cleared, periodic ones leave nothing behind in the TT.
 
-This routine will start mapping the request unless MappingState is Stopped.
-If MappingState is Stopped, request pointer is saved, and it will be mapped
-when the StartMapping callback arrives from ESM.
+If every TtClears entry is taken the request still goes out, but as a
+plain control transfer with the TT left open: the buffer gets cleared,
+only without the hold.
 
 --*/
 {
-	PTR_DATA trData;
-	BOOLEAN                 processTransfer;
-	PTRANSFER_URB           transferUrb;
-	WDF_REQUEST_PARAMETERS  wdfRequestParams;
+	PENDPOINT_DATA endpoint = TrData->EndpointHandle;
+	PUSBDEVICE_DATA usbDevice = endpoint->UsbDeviceHandle;
+	PCONTROLLER_DATA controllerData = usbDevice->ControllerData;
 
-	processTransfer = FALSE;
+	if ((endpoint->Type != EndpointType_Bulk && endpoint->Type != EndpointType_Control) ||
+		usbDevice->UsbDeviceInfo.TtHub == NULL)
+	{
+		return;
+	}
 
-	KdPrint((__FUNCTION__ "\n"));
+	PUSBDEVICE_DATA hubData = GetUsbDeviceData(usbDevice->UsbDeviceInfo.TtHub);
 
-	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
-	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
+	if (hubData->DefaultEndpoint == NULL)
+	{
+		return;
+	}
+
+	PTR_DATA hubTrData = GetTRData(GetEndpointData(hubData->DefaultEndpoint)->IoQueue);
+
+	INT hub = TrData->TrStateMachine.TtHub;
+	INT ttId = TrData->TrStateMachine.TtId;
+	const TR_KIND* kind = &TrKindControl;
+	KIRQL oldIrql;
 
-	transferUrb = (PTRANSFER_URB)wdfRequestParams.Parameters.Others.Arg1;
+	KeAcquireSpinLock(&controllerData->TtLock, &oldIrql);
+
+	for (int i = 0; i < CONTROLLER_MAX_TT_CLEARS; i++)
+	{
+		if (controllerData->TtClears[i].Hub == hub &&
+			controllerData->TtClears[i].TtId == ttId)
+		{
+			// already being cleared
+			KeReleaseSpinLock(&controllerData->TtLock, oldIrql);
+			return;
+		}
+	}
 
-	trData = GetTRData(WdfQueue);
+	for (int i = 0; i < CONTROLLER_MAX_TT_CLEARS; i++)
+	{
+		if (controllerData->TtClears[i].Hub == 0)
+		{
+			controllerData->TtClears[i].Hub = hub;
+			controllerData->TtClears[i].TtId = ttId;
+			kind = &TrKindClearTt;
+			break;
+		}
+	}
 
-	INT channel;
-	NTSTATUS status = Controller_AllocateChannel(trData->EndpointHandle->UsbDeviceHandle->UcxController, &channel);
+	KeReleaseSpinLock(&controllerData->TtLock, oldIrql);
 
-	if (!NT_SUCCESS(status))
+	if (kind != &TrKindClearTt)
 	{
-		WdfRequestComplete(WdfRequest, STATUS_UNSUCCESSFUL);
-		return;
+		KdPrint((__FUNCTION__ ": all %d TT holds taken, clearing hub %d tt %d without holding it\n",
+			CONTROLLER_MAX_TT_CLEARS, hub, ttId));
 	}
 
-	trData->NextStateMachine.Request = WdfRequest;
-	trData->NextStateMachine.Urb = transferUrb;
-	trData->NextStateMachine.State = CHSM_ControlSetup;
-	trData->NextStateMachine.Channel = channel;
-
-	Controller_SetChannelCallback(trData->EndpointHandle->UsbDeviceHandle->UcxController, channel, Controller_RunCHSM, trData);
+	KdPrint((__FUNCTION__ ": hub %d tt %d, device %d ep %d\n", hub, ttId, usbDevice->Address,
+		endpoint->UsbEndpointDescriptor.bEndpointAddress & USB_ENDPOINT_ADDRESS_MASK));
 
-	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
+	USB_DEFAULT_PIPE_SETUP_PACKET setupPacket;
 
-	//TR_RunChSm(trData);
+	USBPORT_INIT_SETUP_PACKET(setupPacket,
+		USB_REQUEST_CLEAR_TT_BUFFER, // bRequest
+		BMREQUEST_HOST_TO_DEVICE, // Dir
+		BMREQUEST_TO_OTHER, // Recipient
+		BMREQUEST_CLASS, // Type
+		(USHORT)((endpoint->UsbEndpointDescriptor.bEndpointAddress & USB_ENDPOINT_ADDRESS_MASK) |
+			((usbDevice->Address & 0x7F) << 4) |
+			((endpoint->UsbEndpointDescriptor.bmAttributes & USB_ENDPOINT_TYPE_MASK) << 11) |
+			(TrData->TrStateMachine.In ? 0x8000 : 0)), // wValue
+		(USHORT)(hubData->NumberOfTTs > 1 ? TrData->TrStateMachine.TtPort : 1), // wIndex
+		0)
 
-	//WdfRequestComplete(WdfRequest, STATUS_NOT_IMPLEMENTED);
+	TR_Submit(hubTrData, NULL, NULL, kind, &setupPacket);
 }
 
-VOID
-Interrupt_WdfEvtIoDefault(
-	WDFQUEUE      WdfQueue,
-	WDFREQUEST    WdfRequest
+BOOLEAN
+TR_PresentNext(
+	PTR_DATA TrData
 )
-{
-	PTR_DATA trData;
-	BOOLEAN                 processTransfer;
-	PTRANSFER_URB           transferUrb;
-	WDF_REQUEST_PARAMETERS  wdfRequestParams;
-
-	processTransfer = FALSE;
-
-	KdPrint((__FUNCTION__ "\n"));
+/*++
 
-	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
-	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
+Routine Description:
 
-	transferUrb = (PTRANSFER_URB)wdfRequestParams.Parameters.Others.Arg1;
+Takes the next client request off the endpoint's manual queue and puts it
+on the submit ring. Only the state machine runner calls this, so requests
+reach the ring, and the bus, in the order the queue delivered them. The
+queue presents nothing on its own; Endpoint_EvtIoReady kicks the runner
+when a request arrives.
 
-	trData = GetTRData(WdfQueue);
+The runner only asks for a request once the ring has run dry, so at most
+one client request is on the ring at a time. The endpoint runs one
+transfer at a time anyway, and the requests behind it wait in the queue,
+where framework cancellation and purge still reach them.
 
-	INT channel;
-	NTSTATUS status = Controller_AllocateChannel(trData->EndpointHandle->UsbDeviceHandle->UcxController, &channel);
+--*/
+{
+	WDFREQUEST request;
+	WDF_REQUEST_PARAMETERS wdfRequestParams;
 
-	if (!NT_SUCCESS(status))
+	// the queue is being purged, what it still holds is completed there
+	if (TrData->AbortPending)
 	{
-		WdfRequestComplete(WdfRequest, STATUS_UNSUCCESSFUL);
-		return;
+		return FALSE;
 	}
 
-	trData->NextStateMachine.Request = WdfRequest;
-	trData->NextStateMachine.Urb = transferUrb;
-	trData->NextStateMachine.State = CHSM_InterruptOrBulkData;
-	trData->NextStateMachine.Channel = channel;
-
-	Controller_SetChannelCallback(trData->EndpointHandle->UsbDeviceHandle->UcxController, channel, Controller_RunCHSM, trData);
-
-	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(TrData->EndpointHandle->IoQueue, &request)))
+	{
+		WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
+		WdfRequestGetParameters(request, &wdfRequestParams);
+
+		if (TR_Push(TrData,
+			request,
+			(PTRANSFER_URB)wdfRequestParams.Parameters.Others.Arg1,
+			(TrData->EndpointHandle->Type == EndpointType_Control) ? &TrKindControl : &TrKindData,
+			NULL))
+		{
+			return TRUE;
+		}
 
-	//TR_RunChSm(trData);
+		// failed and completed already, try the next one
+	}
 
-	//WdfRequestComplete(WdfRequest, STATUS_NOT_IMPLEMENTED);
+	return FALSE;
 }
 
 VOID
-Bulk_WdfEvtIoDefault(
+Endpoint_EvtIoReady(
 	WDFQUEUE      WdfQueue,
-	WDFREQUEST    WdfRequest
+	WDFCONTEXT    WdfContext
 )
 {
-	PTR_DATA trData;
-	BOOLEAN                 processTransfer;
-	PTRANSFER_URB           transferUrb;
-	WDF_REQUEST_PARAMETERS  wdfRequestParams;
-
-	processTransfer = FALSE;
-
-	KdPrint((__FUNCTION__ "\n"));
-
-	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
-	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
-
-	transferUrb = (PTRANSFER_URB)wdfRequestParams.Parameters.Others.Arg1;
-
-	trData = GetTRData(WdfQueue);
-
-	INT channel;
-	NTSTATUS status = Controller_AllocateChannel(trData->EndpointHandle->UsbDeviceHandle->UcxController, &channel);
-
-	if (!NT_SUCCESS(status))
-	{
-		WdfRequestComplete(WdfRequest, STATUS_UNSUCCESSFUL);
-		return;
-	}
-
-	trData->NextStateMachine.Request = WdfRequest;
-	trData->NextStateMachine.Urb = transferUrb;
-	trData->NextStateMachine.State = CHSM_InterruptOrBulkData;
-	trData->NextStateMachine.Channel = channel;
+	UNREFERENCED_PARAMETER(WdfContext);
 
-	Controller_SetChannelCallback(trData->EndpointHandle->UsbDeviceHandle->UcxController, channel, Controller_RunCHSM, trData);
+	PTR_DATA trData = GetTRData(WdfQueue);
 
 	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
-
-	//TR_RunChSm(trData);
-
-	//WdfRequestComplete(WdfRequest, STATUS_NOT_IMPLEMENTED);
 }
 
 NTSTATUS
@@ -1345,19 +2458,13 @@ Endpoint_CreateIoQueue(
 	WDF_IO_QUEUE_CONFIG     wdfIoQueueConfig;
 	WDFQUEUE                wdfQueue;
 
-	WDF_IO_QUEUE_CONFIG_INIT(&wdfIoQueueConfig, WdfIoQueueDispatchSequential);
-	if (Endpoint->Type == EndpointType_Control)
-	{
-		wdfIoQueueConfig.EvtIoDefault = Control_WdfEvtIoDefault;
-	}
-	else if (Endpoint->Type == EndpointType_Interrupt)
-	{
-		wdfIoQueueConfig.EvtIoDefault = Interrupt_WdfEvtIoDefault;
-	}
-	else if (Endpoint->Type == EndpointType_Bulk)
-	{
-		wdfIoQueueConfig.EvtIoDefault = Bulk_WdfEvtIoDefault;
-	}
+	//
+	// Requests are pulled by the state machine runner, one at a time and in
+	// queue order, see TR_PresentNext. A parallel queue would present them
+	// on several processors at once, and the ring would then take them in
+	// whatever order the pushes happened to land.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&wdfIoQueueConfig, WdfIoQueueDispatchManual);
 	wdfIoQueueConfig.PowerManaged = WdfFalse;
 
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfAttributes, TR_DATA);
@@ -1376,14 +2483,44 @@ Endpoint_CreateIoQueue(
 	{
 		PTR_DATA trData = GetTRData(wdfQueue);
 		trData->EndpointHandle = Endpoint;
-		KeInitializeSpinLock(&trData->SpinLock);
+
+		SubmitRing_Init(&trData->SubmitRing);
+
+		KeInitializeDpc(&trData->RunDpc, RunSmDpc, trData);
+
+		trData->GrantedChannel = -1;
+
+		trData->TimeoutEntry.Callback = TR_TimeoutExpired;
+		trData->TimeoutEntry.Context = trData;
 
 		Endpoint->IoQueue = wdfQueue;
+
+		status = WdfIoQueueReadyNotify(wdfQueue, Endpoint_EvtIoReady, NULL);
 	}
 
 	return status;
 }
 
+VOID
+Endpoint_EvtCleanup(
+	_In_ WDFOBJECT UcxEndpoint
+)
+{
+	PENDPOINT_DATA endpointData = GetEndpointData(UcxEndpoint);
+
+	if (endpointData->UsbDeviceHandle != NULL)
+	{
+		Controller_TtRelease(endpointData->UsbDeviceHandle->UcxController, endpointData);
+		Controller_HsRelease(endpointData->UsbDeviceHandle->UcxController, endpointData);
+
+		if (endpointData->FifoAccounted)
+		{
+			Controller_UpdateFifoDemand(endpointData->UsbDeviceHandle->UcxController, endpointData->MaxPacketSize * endpointData->Mult, FALSE);
+			endpointData->FifoAccounted = FALSE;
+		}
+	}
+}
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 NTSTATUS
 Endpoint_Create(
@@ -1405,9 +2542,8 @@ Endpoint_Create(
 
 	PAGED_CODE();
 
-	UNREFERENCED_PARAMETER(UcxController);
-
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfAttributes, ENDPOINT_DATA);
+	wdfAttributes.EvtCleanupCallback = Endpoint_EvtCleanup;
 
 	KdPrint((__FUNCTION__ "\n"));
 
@@ -1428,12 +2564,13 @@ Endpoint_Create(
 		endpointData->UcxUsbDevice = UcxUsbDevice;
 		endpointData->UsbDeviceHandle = GetUsbDeviceData(UcxUsbDevice);
 
-		endpointData->InToggle = DWC_HCTSIZ_DATA0;
-		endpointData->OutToggle = DWC_HCTSIZ_DATA0;
+		Endpoint_ResetToggle(endpointData);
 
 		endpointData->UsbEndpointDescriptor = *UsbEndpointDescriptor;
 
-		endpointData->MaxPacketSize = UsbEndpointDescriptor->wMaxPacketSize;
+		endpointData->MaxPacketSize = USB_MAX_PACKET_SIZE(UsbEndpointDescriptor->wMaxPacketSize);
+		endpointData->Mult = 1;
+		endpointData->TtIndex = -1;
 
 		if ((USB_ENDPOINT_DIRECTION_IN(endpointData->UsbEndpointDescriptor.bEndpointAddress)))
 		{
@@ -1463,6 +2600,29 @@ Endpoint_Create(
 			break;
 		}
 
+		if ((endpointData->Type == EndpointType_Interrupt || endpointData->Type == EndpointType_Isoch) &&
+			endpointData->UsbDeviceHandle->UsbDeviceInfo.DeviceSpeed == UsbHighSpeed)
+		{
+			endpointData->Mult = (UCHAR)min(USB_HIGH_BANDWIDTH_MULT(UsbEndpointDescriptor->wMaxPacketSize), 3);
+		}
+
+		if (endpointData->Type == EndpointType_Control)
+		{
+			endpointData->Priority = ChannelPriorityControl;
+		}
+		else if (endpointData->UsbDeviceHandle->ChannelPriority < ChannelPriorityCount)
+		{
+			endpointData->Priority = endpointData->UsbDeviceHandle->ChannelPriority;
+		}
+		else if (endpointData->Type == EndpointType_Bulk)
+		{
+			endpointData->Priority = ChannelPriorityBulk;
+		}
+		else
+		{
+			endpointData->Priority = ChannelPriorityInterrupt;
+		}
+
 		status = Endpoint_CreateIoQueue(endpointData);
 
 		if (endpointData->Type == EndpointType_Isoch)
@@ -1472,6 +2632,22 @@ Endpoint_Create(
 			status = STATUS_NOT_IMPLEMENTED;
 		}
 
+		if (NT_SUCCESS(status))
+		{
+			status = Controller_TtReserve(UcxController, endpointData);
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			status = Controller_HsReserve(UcxController, endpointData);
+		}
+
+		if (NT_SUCCESS(status) && endpointData->Type == EndpointType_Interrupt)
+		{
+			Controller_UpdateFifoDemand(UcxController, endpointData->MaxPacketSize * endpointData->Mult, TRUE);
+			endpointData->FifoAccounted = TRUE;
+		}
+
 		if (NT_SUCCESS(status))
 		{
 			UcxEndpointSetWdfIoQueue(ucxEndpoint, endpointData->IoQueue);
@@ -1511,6 +2687,27 @@ Endpoint_WdfEvtAbortComplete(
 	UcxEndpointAbortComplete(ucxEndpoint);
 }
 
+VOID
+Endpoint_CancelTransfers(
+	PENDPOINT_DATA Endpoint
+)
+/*++
+
+Routine Description:
+
+The queue only purges requests it still holds. Those already handed to the
+channel state machine are cancelled by its runner, which is kicked here so
+that the purge completes without waiting for a channel interrupt.
+
+--*/
+{
+	PTR_DATA trData = GetTRData(Endpoint->IoQueue);
+
+	InterlockedExchange(&trData->AbortPending, 1);
+
+	Controller_InvokeTrSm(Endpoint->UsbDeviceHandle->UcxController, trData);
+}
+
 VOID
 Endpoint_UcxEvtEndpointStart(
 	UCXCONTROLLER   UcxController,
@@ -1521,11 +2718,14 @@ Endpoint_UcxEvtEndpointStart(
 
 	KdPrint((__FUNCTION__ "\n"));
 
-	UNREFERENCED_PARAMETER(UcxController);
-
 	endpointData = GetEndpointData(UcxEndpoint);
 
+	InterlockedExchange(&GetTRData(endpointData->IoQueue)->AbortPending, 0);
+
 	WdfIoQueueStart(endpointData->IoQueue);
+
+	// pick up whatever arrived while the endpoint was stopped
+	Controller_InvokeTrSm(UcxController, GetTRData(endpointData->IoQueue));
 }
 
 VOID
@@ -1542,6 +2742,8 @@ Endpoint_UcxEvtEndpointAbort(
 
 	endpointData = GetEndpointData(UcxEndpoint);
 
+	Endpoint_CancelTransfers(endpointData);
+
 	WdfIoQueueStopAndPurge(endpointData->IoQueue, Endpoint_WdfEvtAbortComplete, UcxEndpoint);
 }
 
@@ -1559,6 +2761,8 @@ Endpoint_UcxEvtEndpointPurge(
 
 	endpointData = GetEndpointData(UcxEndpoint);
 
+	Endpoint_CancelTransfers(endpointData);
+
 	WdfIoQueuePurge(endpointData->IoQueue, Endpoint_WdfEvtPurgeComplete, UcxEndpoint);
 }
 
@@ -1572,8 +2776,11 @@ Endpoint_UcxEvtEndpointReset(
 	KdPrint((__FUNCTION__ "\n"));
 
 	UNREFERENCED_PARAMETER(UcxController);
-	UNREFERENCED_PARAMETER(UcxEndpoint);
-	UNREFERENCED_PARAMETER(WdfRequest);
+
+	//
+	// Clearing a halt puts the device end back on DATA0.
+	//
+	Endpoint_ResetToggle(GetEndpointData(UcxEndpoint));
 
 	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 }
@@ -1813,6 +3020,13 @@ UsbDevice_UcxEvtHubInfo(
 
 	hubInfo = (PUSBDEVICE_HUB_INFO)wdfRequestParams.Parameters.Others.Arg1;
 
+	PUSBDEVICE_DATA usbDeviceData = GetUsbDeviceData(hubInfo->UsbDevice);
+
+	usbDeviceData->NumberOfTTs = hubInfo->NumberOfTTs;
+	usbDeviceData->TTThinkTime = hubInfo->TTThinkTime;
+
+	KdPrint((__FUNCTION__ ": hub %d has %d TTs\n", usbDeviceData->Address, hubInfo->NumberOfTTs));
+
 	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 }
 
@@ -1889,6 +3103,13 @@ UsbDevice_UcxEvtEnable(
 	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 }
 
+VOID
+USBPORT_FreeUsbAddress(
+	UCXCONTROLLER UcxController,
+	UCXUSBDEVICE UcxUsbDevice,
+	USHORT Address
+);
+
 VOID
 UsbDevice_UcxEvtDisable(
 	UCXCONTROLLER   UcxController,
@@ -1900,8 +3121,6 @@ UsbDevice_UcxEvtDisable(
 	WDF_REQUEST_PARAMETERS  wdfRequestParams;
 	PUSBDEVICE_DISABLE usbDeviceDisable;
 
-	UNREFERENCED_PARAMETER(UcxController);
-
 	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
 	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
 
@@ -1909,7 +3128,9 @@ UsbDevice_UcxEvtDisable(
 
 	PUSBDEVICE_DATA usbDeviceData = GetUsbDeviceData(usbDeviceDisable->UsbDevice);
 
-	UNREFERENCED_PARAMETER(usbDeviceData);
+	USBPORT_FreeUsbAddress(UcxController, usbDeviceDisable->UsbDevice, usbDeviceData->AssignedAddress);
+	usbDeviceData->AssignedAddress = 0;
+	usbDeviceData->Address = 0;
 
 	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 }
@@ -1936,12 +3157,22 @@ UsbDevice_UcxEvtEndpointsConfigure(
 
 	UNREFERENCED_PARAMETER(usbDeviceData);
 
+	//
+	// SET_CONFIGURATION and SET_INTERFACE start every endpoint they
+	// enable on DATA0.
+	//
+	for (ULONG i = 0; i < endpointsConfigure->EndpointsToEnableCount; i++)
+	{
+		Endpoint_ResetToggle(GetEndpointData(endpointsConfigure->EndpointsToEnable[i]));
+	}
+
 	WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 }
 
 NTSTATUS
 USBPORT_AllocateUsbAddress(
 	UCXCONTROLLER UcxController,
+	UCXUSBDEVICE UcxUsbDevice,
 	PUSHORT AssignedAddress
 )
 /*++
@@ -1951,57 +3182,36 @@ Routine Description:
 Allocates a USB address from a bitmap of availble addresses. Valid USB address (1..127) to use for a device.
 returns 0 and STATUS_INSUFFICIENT_RESOURCES if no device address available.
 
+The device is entered in the controller's device table under that address.
+
 --*/
 {
 	PCONTROLLER_DATA controllerData;
 	USHORT address;
 	NTSTATUS nts;
-	PUSB_ADDRESS_LIST usbAddressList;
 	ULONG bit;
+	KIRQL oldIrql;
 
 	controllerData = ControllerGetData(UcxController);
 
-	do {
-		nts = STATUS_INSUFFICIENT_RESOURCES;
-		address = 0;
-
-		if (controllerData->UsbAddressInit == 0) {
-			usbAddressList = &controllerData->UsbAddressList;
-
-			if (usbAddressList) {
-				RtlInitializeBitMap(&usbAddressList->Bitmap,
-					&usbAddressList->Bits[0],
-					USB_MAX_ADDRESS_COUNT);
-
-				RtlClearAllBits(&usbAddressList->Bitmap);
-				// reserve bit 0 (default address)
-				RtlSetBit(&usbAddressList->Bitmap, 0);
+	nts = STATUS_INSUFFICIENT_RESOURCES;
+	address = 0;
 
-				controllerData->UsbAddressInit = 1;
-			}
-
-		}
-		else {
-			usbAddressList = &controllerData->UsbAddressList;
-		}
+	KeAcquireSpinLock(&controllerData->AddressLock, &oldIrql);
 
-		if (usbAddressList == NULL) {
-			break;
-		}
+	bit = RtlFindClearBitsAndSet(&controllerData->UsbAddressList.Bitmap, 1, 1);
 
-		bit = RtlFindClearBits(&usbAddressList->Bitmap, 1, 1);
-
-		// if in range assign address
-		if ((bit != 0) && (bit < USB_MAX_ADDRESS_COUNT)) {
-			address = (USHORT)bit;
-			RtlSetBit(&usbAddressList->Bitmap, bit);
-			nts = STATUS_SUCCESS;
-		}
+	// if in range assign address
+	if ((bit != 0xFFFFFFFF) && (bit != 0) && (bit < USB_MAX_ADDRESS_COUNT)) {
+		address = (USHORT)bit;
+		DeviceTable_Insert(&controllerData->UsbDevices, address, UcxUsbDevice);
+		nts = STATUS_SUCCESS;
+	}
 
-	}while(0);
+	KeReleaseSpinLock(&controllerData->AddressLock, oldIrql);
 
 #if DBG
-	if (address == 0 && usbAddressList) {
+	if (address == 0) {
 		// no free addresses?
 		NT_ASSERTMSG("No free addresses", FALSE);
 	}
@@ -2014,6 +3224,58 @@ returns 0 and STATUS_INSUFFICIENT_RESOURCES if no device address available.
 	return nts;
 }
 
+VOID
+USBPORT_FreeUsbAddress(
+	UCXCONTROLLER UcxController,
+	UCXUSBDEVICE UcxUsbDevice,
+	USHORT Address
+)
+{
+	PCONTROLLER_DATA controllerData = ControllerGetData(UcxController);
+	KIRQL oldIrql;
+
+	if (Address == 0 || Address >= USB_MAX_ADDRESS_COUNT)
+	{
+		return;
+	}
+
+	KdPrint(("'USBPORT releasing Address %d\n", Address));
+
+	KeAcquireSpinLock(&controllerData->AddressLock, &oldIrql);
+
+	DeviceTable_Remove(&controllerData->UsbDevices, Address, UcxUsbDevice);
+	RtlClearBit(&controllerData->UsbAddressList.Bitmap, Address);
+
+	KeReleaseSpinLock(&controllerData->AddressLock, oldIrql);
+}
+
+UCXUSBDEVICE
+Controller_GetUsbDevice(
+	_In_ UCXCONTROLLER UcxController,
+	_In_ USHORT Address
+)
+/*++
+
+Routine Description:
+
+Looks a device up by the address it was assigned. Returns NULL for
+unassigned addresses, including the default address.
+
+--*/
+{
+	PCONTROLLER_DATA controllerData = ControllerGetData(UcxController);
+	UCXUSBDEVICE usbDevice;
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&controllerData->AddressLock, &oldIrql);
+
+	usbDevice = (UCXUSBDEVICE)DeviceTable_Lookup(&controllerData->UsbDevices, Address);
+
+	KeReleaseSpinLock(&controllerData->AddressLock, oldIrql);
+
+	return usbDevice;
+}
+
 VOID
 RunSmDpc(
 	_In_     struct _KDPC *Dpc,
@@ -2023,13 +3285,10 @@ RunSmDpc(
 )
 {
 	UNREFERENCED_PARAMETER(Dpc);
-	UNREFERENCED_PARAMETER(DeferredContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
 	UNREFERENCED_PARAMETER(SystemArgument2);
 
-	PTR_DATA trData = (PTR_DATA)SystemArgument1;
-
-	KdPrint((__FUNCTION__ ": last state %d, next state %d\n", trData->StateMachine.State, trData->NextStateMachine.State));
-	trData->StateMachine = trData->NextStateMachine;
+	PTR_DATA trData = (PTR_DATA)DeferredContext;
 
 	TR_RunChSm(trData);
 }
@@ -2040,18 +3299,12 @@ Controller_InvokeTrSm(
 	_In_ PTR_DATA TrData
 )
 {
-	PCONTROLLER_DATA controllerData = ControllerGetData(UcxController);
-
-	INT channel = TrData->NextStateMachine.Channel;
-
-	if (!controllerData->ChSmDpcInited[channel])
-	{
-		KeInitializeDpc(&controllerData->ChSmDpc[channel], RunSmDpc, NULL);
-
-		controllerData->ChSmDpcInited[channel] = TRUE;
-	}
+	UNREFERENCED_PARAMETER(UcxController);
 
-	KeInsertQueueDpc(&controllerData->ChSmDpc[channel], TrData, NULL);
+	//
+	// If the DPC is already queued the runner will see this submission anyway.
+	//
+	KeInsertQueueDpc(&TrData->RunDpc, NULL, NULL);
 }
 
 VOID
@@ -2064,7 +3317,6 @@ Controller_ResumeCh(
 
 	PTR_DATA trData = *(PTR_DATA*)Context;
 
-	trData->NextStateMachine = trData->StateMachine;
 	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
 }
 
@@ -2079,7 +3331,6 @@ UsbDevice_UcxEvtAddress(
 	WDF_REQUEST_PARAMETERS  wdfRequestParams;
 	PUSBDEVICE_ADDRESS usbDeviceAddress;
 
-	UNREFERENCED_PARAMETER(UcxController);
 
 	WDF_REQUEST_PARAMETERS_INIT(&wdfRequestParams);
 	WdfRequestGetParameters(WdfRequest, &wdfRequestParams);
@@ -2090,38 +3341,101 @@ UsbDevice_UcxEvtAddress(
 
 	PENDPOINT_DATA endpointData = GetEndpointData(usbDeviceData->DefaultEndpoint);
 
+	//
+	// Addressing a device again after a reset gives up the old address.
+	//
+	USBPORT_FreeUsbAddress(UcxController, usbDeviceAddress->UsbDevice, usbDeviceData->AssignedAddress);
+	usbDeviceData->AssignedAddress = 0;
+
 	USHORT address;
-	if (!NT_SUCCESS(USBPORT_AllocateUsbAddress(UcxController, &address)))
+	if (!NT_SUCCESS(USBPORT_AllocateUsbAddress(UcxController, usbDeviceAddress->UsbDevice, &address)))
 	{
 		WdfRequestComplete(WdfRequest, STATUS_UNSUCCESSFUL);
 		return;
 	}
 
-	INT channel;
-	NTSTATUS status = Controller_AllocateChannel(endpointData->UsbDeviceHandle->UcxController, &channel);
-
-	if (!NT_SUCCESS(status))
-	{
-		WdfRequestComplete(WdfRequest, STATUS_UNSUCCESSFUL);
-		return;
-	}
+	usbDeviceData->AssignedAddress = address;
 
 	PTR_DATA trData = GetTRData(endpointData->IoQueue);
-	trData->NextStateMachine.Request = WdfRequest;
-	trData->NextStateMachine.State = CHSM_AddressSetup;
-	trData->NextStateMachine.Address = address;
-	trData->NextStateMachine.Channel = channel;
 	
 	usbDeviceAddress->Address = address;
 
-	Controller_SetChannelCallback(trData->EndpointHandle->UsbDeviceHandle->UcxController, channel, Controller_RunCHSM, trData);
+	//
+	// SET_ADDRESS is an ordinary control transfer on the default endpoint,
+	// each device with its own setup packet, so devices on different hubs
+	// can be addressed at the same time.
+	//
+	USB_DEFAULT_PIPE_SETUP_PACKET setupPacket;
+
+	USBPORT_INIT_SETUP_PACKET(setupPacket,
+		USB_REQUEST_SET_ADDRESS, // bRequest
+		BMREQUEST_HOST_TO_DEVICE, // Dir
+		BMREQUEST_TO_DEVICE, // Recipient
+		BMREQUEST_STANDARD, // Type
+		address, // wValue
+		0, // wIndex
+		0)
 
-	Controller_InvokeTrSm(trData->EndpointHandle->UsbDeviceHandle->UcxController, trData);
+	TR_Submit(trData, WdfRequest, NULL, &TrKindAddress, &setupPacket);
 
 	//WdfRequestComplete(WdfRequest, STATUS_SUCCESS);
 
 }
 
+CHANNEL_PRIORITY
+UsbDevice_QueryChannelPriority(
+	UCXCONTROLLER       UcxController,
+	PUCXUSBDEVICE_INFO  UsbDeviceInfo
+)
+/*++
+
+Routine Description:
+
+Looks up a channel class override for the device in the controller's
+device parameters. The value is named after the port path, so
+ChannelPriority1.3 is the device on port 3 of the hub on root port 1.
+
+--*/
+{
+	WCHAR valueName[48] = L"ChannelPriority";
+	ULONG length = RTL_NUMBER_OF(L"ChannelPriority") - 1;
+
+	PAGED_CODE();
+
+	for (ULONG i = 0; i < UsbDeviceInfo->PortPath.PortPathDepth && i < 6; i++)
+	{
+		ULONG port = UsbDeviceInfo->PortPath.PortPath[i];
+
+		if (i != 0)
+		{
+			valueName[length++] = L'.';
+		}
+
+		if (port >= 10)
+		{
+			valueName[length++] = (WCHAR)(L'0' + (port / 10) % 10);
+		}
+
+		valueName[length++] = (WCHAR)(L'0' + port % 10);
+	}
+
+	valueName[length] = L'\0';
+
+	ULONG priority = Controller_QueryParameter(Controller_GetWdfDevice(UcxController), valueName, ChannelPriorityCount);
+
+	if (priority > ChannelPriorityCount)
+	{
+		priority = ChannelPriorityCount;
+	}
+
+	if (priority != ChannelPriorityCount)
+	{
+		KdPrint((__FUNCTION__ ": %S is class %d\n", valueName, priority));
+	}
+
+	return (CHANNEL_PRIORITY)priority;
+}
+
 NTSTATUS
 UsbDevice_UcxEvtDeviceAdd(
 	UCXCONTROLLER       UcxController,
@@ -2172,20 +3486,8 @@ UsbDevice_UcxEvtDeviceAdd(
 		usbDeviceData->UcxUsbDevice = ucxUsbDevice;
 		usbDeviceData->UcxController = UcxController;
 		usbDeviceData->UsbDeviceInfo = *UsbDeviceInfo;
-
-		LARGE_INTEGER hostBase;
-		hostBase.QuadPart = DWUSB_BASE + 0x400;
-
-		usbDeviceData->HostGlobalRegs = MmMapIoSpace(hostBase, sizeof(dwc_otg_host_global_regs_t), MmNonCached);
-		
-		LARGE_INTEGER channelBase;
-		channelBase.QuadPart = DWUSB_BASE + DWC_OTG_HOST_CHAN_REGS_OFFSET;
-
-		for (int i = 0; i < 16; i++)
-		{
-			usbDeviceData->ChannelRegs[i] = MmMapIoSpace(channelBase, sizeof(dwc_otg_hc_regs_t), MmNonCached);
-			channelBase.QuadPart += DWC_OTG_CHAN_REGS_OFFSET;
-		}
+		usbDeviceData->ControllerData = ControllerGetData(UcxController);
+		usbDeviceData->ChannelPriority = UsbDevice_QueryChannelPriority(UcxController, UsbDeviceInfo);
 	}
 
 	return status;
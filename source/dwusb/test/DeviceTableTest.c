@@ -0,0 +1,153 @@
+/*++
+
+Module Name:
+
+    DeviceTableTest.c
+
+Abstract:
+
+    Tests of the device-by-address table.
+
+--*/
+
+#include "host.h"
+#include "../DeviceTable.h"
+
+static int DeviceA;
+static int DeviceB;
+
+static
+VOID
+TestEmpty(
+	VOID
+)
+{
+	USB_DEVICE_TABLE table = { 0 };
+
+	for (USHORT address = 0; address < USB_MAX_ADDRESS_COUNT + 2; address++)
+	{
+		CHECK(DeviceTable_Lookup(&table, address) == NULL);
+	}
+}
+
+static
+VOID
+TestRange(
+	VOID
+)
+{
+	USB_DEVICE_TABLE table = { 0 };
+
+	// the default address and anything past 127 are never entered
+	CHECK(!DeviceTable_Insert(&table, 0, &DeviceA));
+	CHECK(!DeviceTable_Insert(&table, USB_MAX_ADDRESS_COUNT, &DeviceA));
+	CHECK(DeviceTable_Lookup(&table, 0) == NULL);
+
+	CHECK(DeviceTable_Insert(&table, 1, &DeviceA));
+	CHECK(DeviceTable_Insert(&table, USB_MAX_ADDRESS_COUNT - 1, &DeviceB));
+	CHECK(DeviceTable_Lookup(&table, 1) == &DeviceA);
+	CHECK(DeviceTable_Lookup(&table, USB_MAX_ADDRESS_COUNT - 1) == &DeviceB);
+	CHECK(DeviceTable_Lookup(&table, 2) == NULL);
+}
+
+static
+VOID
+TestFull(
+	VOID
+)
+{
+	USB_DEVICE_TABLE table = { 0 };
+	static UCHAR devices[USB_MAX_ADDRESS_COUNT];
+
+	for (USHORT address = 1; address < USB_MAX_ADDRESS_COUNT; address++)
+	{
+		CHECK(DeviceTable_Insert(&table, address, &devices[address]));
+	}
+
+	for (USHORT address = 1; address < USB_MAX_ADDRESS_COUNT; address++)
+	{
+		CHECK(DeviceTable_Lookup(&table, address) == &devices[address]);
+	}
+
+	for (USHORT address = 1; address < USB_MAX_ADDRESS_COUNT; address += 2)
+	{
+		DeviceTable_Remove(&table, address, &devices[address]);
+	}
+
+	for (USHORT address = 1; address < USB_MAX_ADDRESS_COUNT; address++)
+	{
+		CHECK(DeviceTable_Lookup(&table, address) == ((address & 1) ? NULL : &devices[address]));
+	}
+}
+
+static
+VOID
+TestOwnership(
+	VOID
+)
+{
+	USB_DEVICE_TABLE table = { 0 };
+
+	CHECK(DeviceTable_Insert(&table, 5, &DeviceA));
+
+	// entering the same device again is fine, another one is refused
+	CHECK(DeviceTable_Insert(&table, 5, &DeviceA));
+	CHECK(!DeviceTable_Insert(&table, 5, &DeviceB));
+	CHECK(DeviceTable_Lookup(&table, 5) == &DeviceA);
+
+	// only the device entered under an address removes it
+	DeviceTable_Remove(&table, 5, &DeviceB);
+	CHECK(DeviceTable_Lookup(&table, 5) == &DeviceA);
+
+	DeviceTable_Remove(&table, 5, &DeviceA);
+	CHECK(DeviceTable_Lookup(&table, 5) == NULL);
+
+	// removing what is not there, or out of range, does nothing
+	DeviceTable_Remove(&table, 5, &DeviceA);
+	DeviceTable_Remove(&table, 0, &DeviceA);
+	DeviceTable_Remove(&table, USB_MAX_ADDRESS_COUNT, &DeviceA);
+	CHECK(DeviceTable_Lookup(&table, 5) == NULL);
+}
+
+static
+VOID
+TestReaddress(
+	VOID
+)
+{
+	USB_DEVICE_TABLE table = { 0 };
+
+	//
+	// A device reset and addressed again gives up its old address first,
+	// which another device may then take before the first is disabled.
+	//
+	CHECK(DeviceTable_Insert(&table, 3, &DeviceA));
+
+	DeviceTable_Remove(&table, 3, &DeviceA);
+	CHECK(DeviceTable_Insert(&table, 4, &DeviceA));
+	CHECK(DeviceTable_Insert(&table, 3, &DeviceB));
+
+	CHECK(DeviceTable_Lookup(&table, 3) == &DeviceB);
+	CHECK(DeviceTable_Lookup(&table, 4) == &DeviceA);
+
+	// disabling A with a stale address must not drop B
+	DeviceTable_Remove(&table, 3, &DeviceA);
+	DeviceTable_Remove(&table, 4, &DeviceA);
+
+	CHECK(DeviceTable_Lookup(&table, 3) == &DeviceB);
+	CHECK(DeviceTable_Lookup(&table, 4) == NULL);
+}
+
+int
+main(
+	VOID
+)
+{
+	TestEmpty();
+	TestRange();
+	TestFull();
+	TestOwnership();
+	TestReaddress();
+
+	return TEST_RESULT();
+}
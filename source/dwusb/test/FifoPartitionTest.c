@@ -0,0 +1,157 @@
+/*++
+
+Module Name:
+
+    FifoPartitionTest.c
+
+Abstract:
+
+    Tests of the FIFO RAM split, FifoPartition_Compute.
+
+--*/
+
+#include "host.h"
+
+#include "../FifoPartition.h"
+
+#define FIFO_MIN_DEPTH (DWC_FIFO_RX_MIN + DWC_FIFO_NPTX_MIN + DWC_FIFO_PTX_MIN)
+
+typedef struct _FIFO_CASE {
+	ULONG Depth;
+	ULONG PeriodicWords;
+	ULONG Rx;
+	ULONG NpTx;
+	ULONG PTx;
+} FIFO_CASE;
+
+static
+VOID
+CheckCases(
+	const FIFO_CASE* Cases,
+	ULONG Count
+)
+{
+	for (ULONG i = 0; i < Count; i++)
+	{
+		FIFO_PARTITION partition = { 0 };
+
+		CHECK(FifoPartition_Compute(Cases[i].Depth, Cases[i].PeriodicWords, &partition));
+		CHECK_EQ(partition.Rx, Cases[i].Rx);
+		CHECK_EQ(partition.NpTx, Cases[i].NpTx);
+		CHECK_EQ(partition.PTx, Cases[i].PTx);
+	}
+}
+
+static
+VOID
+TestTooSmall(
+	VOID
+)
+{
+	FIFO_PARTITION partition;
+
+	CHECK(!FifoPartition_Compute(0, 0, &partition));
+	CHECK(!FifoPartition_Compute(DWC_FIFO_RX_MIN, 0, &partition));
+	CHECK(!FifoPartition_Compute(FIFO_MIN_DEPTH - 1, 0, &partition));
+	CHECK(!FifoPartition_Compute(FIFO_MIN_DEPTH - 1, 0x1000, &partition));
+}
+
+static
+VOID
+TestSmallDepths(
+	VOID
+)
+{
+	static const FIFO_CASE cases[] = {
+		// exactly the minimums, whatever the periodic endpoints want
+		{ FIFO_MIN_DEPTH, 0, DWC_FIFO_RX_MIN, DWC_FIFO_NPTX_MIN, DWC_FIFO_PTX_MIN },
+		{ FIFO_MIN_DEPTH, 1000, DWC_FIFO_RX_MIN, DWC_FIFO_NPTX_MIN, DWC_FIFO_PTX_MIN },
+
+		// one word over goes to non-periodic TX unless periodic TX asks for it
+		{ FIFO_MIN_DEPTH + 1, 0, DWC_FIFO_RX_MIN, DWC_FIFO_NPTX_MIN + 1, DWC_FIFO_PTX_MIN },
+		{ FIFO_MIN_DEPTH + 1, 1000, DWC_FIFO_RX_MIN, DWC_FIFO_NPTX_MIN, DWC_FIFO_PTX_MIN + 1 },
+
+		// 3/8 is still under the RX minimum
+		{ 693, 0, DWC_FIFO_RX_MIN, 693 - DWC_FIFO_RX_MIN - DWC_FIFO_PTX_MIN, DWC_FIFO_PTX_MIN },
+
+		// and just over it
+		{ 1000, 0, 375, 609, DWC_FIFO_PTX_MIN },
+		{ 1000, 100, 375, 525, 100 },
+	};
+
+	CheckCases(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+static
+VOID
+TestLargeDepths(
+	VOID
+)
+{
+	static const FIFO_CASE cases[] = {
+		// the BCM2835's 4080 words
+		{ 4080, 0, 1530, 2534, DWC_FIFO_PTX_MIN },
+		{ 4080, 768, 1530, 1782, 768 },
+		{ 4080, 100000, 1530, DWC_FIFO_NPTX_MIN, 2294 },
+
+		{ 0x8000, 0, 12288, 20464, DWC_FIFO_PTX_MIN },
+		{ 0x8000, 1024, 12288, 19456, 1024 },
+
+		// the largest GHWCFG3 can report
+		{ 0xFFFF, 0, 24575, 40944, DWC_FIFO_PTX_MIN },
+		{ 0xFFFF, 4096, 24575, 36864, 4096 },
+		{ 0xFFFF, 0xFFFFFFFF, 24575, DWC_FIFO_NPTX_MIN, 40704 },
+	};
+
+	CheckCases(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+static
+VOID
+TestAllDepths(
+	VOID
+)
+{
+	static const ULONG periodic[] = { 0, 1, DWC_FIFO_PTX_MIN, 0x100, 0x1000, 0xFFFF, 0xFFFFFFFF };
+
+	//
+	// Every depth GHWCFG3 can report: the parts fill the FIFO exactly, none
+	// is under its minimum, and periodic TX gets what it asked for whenever
+	// that fits.
+	//
+	for (ULONG depth = FIFO_MIN_DEPTH; depth <= 0xFFFF; depth++)
+	{
+		for (ULONG i = 0; i < sizeof(periodic) / sizeof(periodic[0]); i++)
+		{
+			FIFO_PARTITION partition;
+			ULONG rx = (depth * 3) / 8 < DWC_FIFO_RX_MIN ? DWC_FIFO_RX_MIN : (depth * 3) / 8;
+			ULONG room = depth - rx - DWC_FIFO_NPTX_MIN;
+
+			if (!FifoPartition_Compute(depth, periodic[i], &partition) ||
+				partition.Rx + partition.NpTx + partition.PTx != depth ||
+				partition.Rx != rx ||
+				partition.NpTx < DWC_FIFO_NPTX_MIN ||
+				partition.PTx < DWC_FIFO_PTX_MIN ||
+				partition.PTx > room ||
+				(periodic[i] >= DWC_FIFO_PTX_MIN && periodic[i] <= room && partition.PTx != periodic[i]))
+			{
+				CHECK_EQ(depth, 0);
+				CHECK_EQ(periodic[i], 0);
+				return;
+			}
+		}
+	}
+}
+
+int
+main(
+	VOID
+)
+{
+	TestTooSmall();
+	TestSmallDepths();
+	TestLargeDepths();
+	TestAllDepths();
+
+	return TEST_RESULT();
+}
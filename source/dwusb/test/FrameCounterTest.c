@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+    FrameCounterTest.c
+
+Abstract:
+
+    Tests of the hfnum.frnum extension, FrameCounter_Extend.
+
+--*/
+
+#include "host.h"
+
+// as in dwc_otg_regs.h
+#define DWC_HFNUM_MAX_FRNUM 0x3FFF
+
+#include "../FrameCounter.h"
+
+#include <stdlib.h>
+
+#define LAP ((LONG64)DWC_FRNUM_LAP)
+#define UFRAMES(n) ((ULONG64)(n) * DWC_MICROFRAME_TIME)
+
+static
+VOID
+TestWithinLap(
+	VOID
+)
+{
+	// nothing moved
+	CHECK_EQ(FrameCounter_Extend(100, 0, 100), 100);
+
+	// time and frame counter agree
+	CHECK_EQ(FrameCounter_Extend(100, UFRAMES(50), 150), 150);
+
+	// less than a microframe of time still reads the new frame number
+	CHECK_EQ(FrameCounter_Extend(100, UFRAMES(1) - 1, 101), 101);
+
+	// the time is a bit ahead of or behind the frame counter
+	CHECK_EQ(FrameCounter_Extend(100, UFRAMES(60), 150), 150);
+	CHECK_EQ(FrameCounter_Extend(100, UFRAMES(40), 150), 150);
+}
+
+static
+VOID
+TestWrap(
+	VOID
+)
+{
+	// frnum wraps from 0x3FFF to 0
+	CHECK_EQ(FrameCounter_Extend(LAP - 2, UFRAMES(3), 1), LAP + 1);
+	CHECK_EQ(FrameCounter_Extend(LAP - 1, UFRAMES(1), 0), LAP);
+
+	// the time says the wrap happened, the frame counter hasn't got there
+	CHECK_EQ(FrameCounter_Extend(LAP - 10, UFRAMES(12), LAP - 1), LAP - 1);
+
+	// the frame counter wrapped, the time says it shouldn't have yet
+	CHECK_EQ(FrameCounter_Extend(LAP - 10, UFRAMES(5), 2), LAP + 2);
+
+	// far into the 64-bit range
+	LONG64 base = 0x123456789 * LAP;
+	CHECK_EQ(FrameCounter_Extend(base - 1, UFRAMES(2), 1), base + 1);
+}
+
+static
+VOID
+TestLongGaps(
+	VOID
+)
+{
+	// many laps without a call, however long, come out exact
+	CHECK_EQ(FrameCounter_Extend(5, UFRAMES(10 * LAP), 5), 5 + 10 * LAP);
+	CHECK_EQ(FrameCounter_Extend(5, UFRAMES(10 * LAP + 7), 12), 5 + 10 * LAP + 7);
+	CHECK_EQ(FrameCounter_Extend(5, UFRAMES(1000000 * LAP + 3), 8), 5 + 1000000 * LAP + 3);
+
+	// with the time a few hundred microframes off either way
+	CHECK_EQ(FrameCounter_Extend(5, UFRAMES(10 * LAP + 400), 5), 5 + 10 * LAP);
+	CHECK_EQ(FrameCounter_Extend(5, UFRAMES(10 * LAP - 400), 5), 5 + 10 * LAP);
+}
+
+static
+VOID
+TestStopped(
+	VOID
+)
+{
+	//
+	// The frame counter stood still during a port reset while time went
+	// on. The result falls behind Last, which the caller then keeps.
+	//
+	CHECK(FrameCounter_Extend(1000, UFRAMES(200), 1000) == 1000);
+	CHECK(FrameCounter_Extend(1000, UFRAMES(200), 990) < 1000);
+}
+
+static
+VOID
+TestRandom(
+	VOID
+)
+{
+	//
+	// Any true advance, with the time off by up to just under half a lap
+	// either way, is recovered exactly.
+	//
+	srand(1);
+
+	for (int i = 0; i < 1000000; i++)
+	{
+		LONG64 last = ((LONG64)rand() << 20) ^ rand();
+		LONG64 advance = (rand() & 1) ? rand() % (4 * LAP) : ((LONG64)rand() << 16);
+		LONG64 jitter = (rand() % (LAP - 2)) - (LAP / 2 - 1);
+
+		if (advance + jitter < 0)
+		{
+			jitter = -advance;
+		}
+
+		LONG64 counter = FrameCounter_Extend(last, UFRAMES(advance + jitter), (ULONG)((last + advance) & DWC_HFNUM_MAX_FRNUM));
+
+		if (counter != last + advance)
+		{
+			CHECK_EQ(counter, last + advance);
+			break;
+		}
+	}
+}
+
+int
+main(
+	VOID
+)
+{
+	TestWithinLap();
+	TestWrap();
+	TestLongGaps();
+	TestStopped();
+	TestRandom();
+
+	return TEST_RESULT();
+}
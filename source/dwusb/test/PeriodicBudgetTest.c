@@ -0,0 +1,224 @@
+/*++
+
+Module Name:
+
+    PeriodicBudgetTest.c
+
+Abstract:
+
+    Tests of the periodic admission arithmetic, PeriodicBudget.h.
+
+--*/
+
+#include "host.h"
+
+#include "../PeriodicBudget.h"
+
+static
+VOID
+TestCosts(
+	VOID
+)
+{
+	// 64 bytes stuffed are 74 byte times, plus the overhead
+	CHECK_EQ(PeriodicBudget_TtCost(64, FALSE), 87);
+	CHECK_EQ(PeriodicBudget_TtCost(64, TRUE), 87 * 8);
+	CHECK_EQ(PeriodicBudget_TtCost(8, TRUE), 22 * 8);
+	CHECK_EQ(PeriodicBudget_TtCost(0, FALSE), TT_TRANSACTION_OVERHEAD);
+
+	CHECK_EQ(PeriodicBudget_HsCost(1024, 1), 1194 + HS_TRANSACTION_OVERHEAD);
+	CHECK_EQ(PeriodicBudget_HsCost(1024, 3), 3 * (1194 + HS_TRANSACTION_OVERHEAD));
+	CHECK_EQ(PeriodicBudget_HsCost(8, 1), 9 + HS_TRANSACTION_OVERHEAD);
+}
+
+static
+VOID
+TestTtEmpty(
+	VOID
+)
+{
+	TT_DATA tts[CONTROLLER_MAX_TTS] = { 0 };
+	TT_PLACEMENT placement = { 0 };
+
+	// fits in one microframe, goes to the first
+	CHECK(PeriodicBudget_TtReserve(tts, 2, 0, 87, &placement));
+	CHECK_EQ(placement.Index, 0);
+	CHECK_EQ(placement.First, 0);
+	CHECK_EQ(placement.Span, 1);
+	CHECK_EQ(placement.Share, 87);
+	CHECK_EQ(tts[0].Hub, 2);
+	CHECK_EQ(tts[0].EndpointCount, 1);
+	CHECK_EQ(tts[0].Allocated[0], 87);
+	CHECK_EQ(tts[0].Allocated[1], 0);
+
+	// a whole microframe is exactly one span
+	CHECK(PeriodicBudget_TtReserve(tts, 3, 0, TT_MICROFRAME_BUDGET, &placement));
+	CHECK_EQ(placement.Index, 1);
+	CHECK_EQ(placement.Span, 1);
+	CHECK_EQ(placement.Share, TT_MICROFRAME_BUDGET);
+
+	// one more byte time spreads it over two
+	CHECK(PeriodicBudget_TtReserve(tts, 4, 0, TT_MICROFRAME_BUDGET + 1, &placement));
+	CHECK_EQ(placement.Index, 2);
+	CHECK_EQ(placement.Span, 2);
+	CHECK_EQ(placement.Share, 95);
+	CHECK_EQ(tts[2].Allocated[0], 95);
+	CHECK_EQ(tts[2].Allocated[1], 95);
+
+	// low speed 64 bytes takes four microframes
+	CHECK(PeriodicBudget_TtReserve(tts, 5, 0, PeriodicBudget_TtCost(64, TRUE), &placement));
+	CHECK_EQ(placement.Span, 4);
+	CHECK_EQ(placement.Share, 174);
+
+	// all six periodic microframes, and more than that
+	CHECK(PeriodicBudget_TtReserve(tts, 6, 0, TT_PERIODIC_MICROFRAMES * TT_MICROFRAME_BUDGET, &placement));
+	CHECK_EQ(placement.Span, TT_PERIODIC_MICROFRAMES);
+	CHECK(!PeriodicBudget_TtReserve(tts, 7, 0, TT_PERIODIC_MICROFRAMES * TT_MICROFRAME_BUDGET + 1, &placement));
+	CHECK_EQ(placement.Index, -1);
+	CHECK_EQ(tts[5].EndpointCount, 0);
+}
+
+static
+VOID
+TestTtFull(
+	VOID
+)
+{
+	TT_DATA tts[CONTROLLER_MAX_TTS] = { 0 };
+	TT_PLACEMENT placement = { 0 };
+	TT_PLACEMENT placements[2 * TT_PERIODIC_MICROFRAMES];
+
+	// two 87s per microframe, filled in order
+	for (ULONG i = 0; i < 2 * TT_PERIODIC_MICROFRAMES; i++)
+	{
+		CHECK(PeriodicBudget_TtReserve(tts, 2, 0, 87, &placements[i]));
+		CHECK_EQ(placements[i].Index, 0);
+		CHECK_EQ(placements[i].First, i / 2);
+	}
+
+	CHECK_EQ(tts[0].EndpointCount, 2 * TT_PERIODIC_MICROFRAMES);
+
+	// 14 byte times left in each, not enough for a third
+	CHECK(!PeriodicBudget_TtReserve(tts, 2, 0, 87, &placement));
+	CHECK_EQ(tts[0].EndpointCount, 2 * TT_PERIODIC_MICROFRAMES);
+
+	// but enough for something small
+	CHECK(PeriodicBudget_TtReserve(tts, 2, 0, 14, &placement));
+	CHECK_EQ(placement.First, 0);
+	CHECK_EQ(tts[0].Allocated[0], TT_MICROFRAME_BUDGET);
+	PeriodicBudget_TtRelease(&tts[0], placement.First, placement.Span, placement.Share);
+
+	// two microframes' worth never fits when each only has 14 left
+	CHECK(!PeriodicBudget_TtReserve(tts, 2, 0, 28, &placement));
+
+	// freeing one in microframe 3 makes room there and nowhere else
+	PeriodicBudget_TtRelease(&tts[0], placements[7].First, placements[7].Span, placements[7].Share);
+	CHECK_EQ(tts[0].Allocated[3], 87);
+
+	CHECK(PeriodicBudget_TtReserve(tts, 2, 0, 87, &placement));
+	CHECK_EQ(placement.First, 3);
+	CHECK(!PeriodicBudget_TtReserve(tts, 2, 0, 87, &placement));
+
+	// releasing everything leaves the entry empty
+	for (ULONG i = 0; i < 2 * TT_PERIODIC_MICROFRAMES; i++)
+	{
+		PeriodicBudget_TtRelease(&tts[0], placements[i].First, placements[i].Span, placements[i].Share);
+	}
+
+	CHECK_EQ(tts[0].EndpointCount, 0);
+
+	for (ULONG j = 0; j < TT_PERIODIC_MICROFRAMES; j++)
+	{
+		CHECK_EQ(tts[0].Allocated[j], 0);
+	}
+}
+
+static
+VOID
+TestSeveralTts(
+	VOID
+)
+{
+	TT_DATA tts[CONTROLLER_MAX_TTS] = { 0 };
+	TT_PLACEMENT placement = { 0 };
+	TT_PLACEMENT first = { 0 };
+
+	// each TT has its own budget: the ports of a multi-TT hub, other hubs
+	for (INT i = 0; i < CONTROLLER_MAX_TTS; i++)
+	{
+		CHECK(PeriodicBudget_TtReserve(tts, 2 + i / 4, i % 4, TT_MICROFRAME_BUDGET, &placement));
+		CHECK_EQ(placement.Index, i);
+		CHECK_EQ(placement.First, 0);
+	}
+
+	// no entry left for another TT
+	CHECK(!PeriodicBudget_TtReserve(tts, 20, 0, 1, &placement));
+
+	// a TT that has one goes on using it
+	CHECK(PeriodicBudget_TtReserve(tts, 3, 1, TT_MICROFRAME_BUDGET, &placement));
+	CHECK_EQ(placement.Index, 5);
+	CHECK_EQ(placement.First, 1);
+
+	// an entry emptied goes to the next new TT, starting from nothing
+	PeriodicBudget_TtRelease(&tts[2], 0, 1, TT_MICROFRAME_BUDGET);
+	CHECK(PeriodicBudget_TtReserve(tts, 20, 0, 1, &first));
+	CHECK_EQ(first.Index, 2);
+	CHECK_EQ(first.First, 0);
+	CHECK_EQ(tts[2].Hub, 20);
+	CHECK_EQ(tts[2].Port, 0);
+	CHECK_EQ(tts[2].Allocated[0], 1);
+
+	// an empty entry before a TT's own doesn't take its endpoints
+	PeriodicBudget_TtRelease(&tts[0], 0, 1, TT_MICROFRAME_BUDGET);
+	CHECK(PeriodicBudget_TtReserve(tts, 4, 3, 10, &placement));
+	CHECK_EQ(placement.Index, 11);
+	CHECK_EQ(placement.First, 1);
+	CHECK_EQ(tts[0].EndpointCount, 0);
+}
+
+static
+VOID
+TestHs(
+	VOID
+)
+{
+	ULONG allocated = 0;
+	ULONG cost = PeriodicBudget_HsCost(1024, 1);
+
+	// 80% of a microframe holds four 1024 byte transactions, not five
+	for (int i = 0; i < 4; i++)
+	{
+		CHECK(PeriodicBudget_HsReserve(&allocated, cost));
+	}
+
+	CHECK_EQ(allocated, 4 * cost);
+	CHECK(!PeriodicBudget_HsReserve(&allocated, cost));
+	CHECK_EQ(allocated, 4 * cost);
+
+	// what's left still takes smaller endpoints, up to exactly full
+	CHECK(PeriodicBudget_HsReserve(&allocated, HS_MICROFRAME_BUDGET - allocated));
+	CHECK_EQ(allocated, HS_MICROFRAME_BUDGET);
+	CHECK(!PeriodicBudget_HsReserve(&allocated, 1));
+	CHECK(PeriodicBudget_HsReserve(&allocated, 0));
+
+	// a high bandwidth endpoint counts all of its transactions
+	allocated = 0;
+	CHECK(PeriodicBudget_HsReserve(&allocated, PeriodicBudget_HsCost(1024, 3)));
+	CHECK(PeriodicBudget_HsReserve(&allocated, PeriodicBudget_HsCost(1024, 1)));
+	CHECK(!PeriodicBudget_HsReserve(&allocated, PeriodicBudget_HsCost(1024, 2)));
+	CHECK(!PeriodicBudget_HsReserve(&allocated, PeriodicBudget_HsCost(1024, 3)));
+}
+
+int
+main(
+	VOID
+)
+{
+	TestCosts();
+	TestTtEmpty();
+	TestTtFull();
+	TestSeveralTts();
+	TestHs();
+
+	return TEST_RESULT();
+}
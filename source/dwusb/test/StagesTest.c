@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    StagesTest.c
+
+Abstract:
+
+    Exhaustive tests of the stage layout, TR_LayoutStages, over every kind
+    of transfer in Stages.h.
+
+--*/
+
+#include "host.h"
+
+#include "../Stages.h"
+
+static const ULONG MaxPacketSizes[] = { 8, 16, 32, 64, 512, 1023, 1024 };
+
+#define MAX_LENGTH (3 * 1024 + 1)
+
+static
+BOOLEAN
+SameStage(
+	const TR_STAGE_LAYOUT* Stage,
+	UCHAR Pid,
+	UCHAR Buffer,
+	BOOLEAN In,
+	ULONG Length,
+	BOOLEAN ReportLength,
+	BOOLEAN Zlp
+)
+{
+	return Stage->Pid == Pid &&
+		Stage->Buffer == Buffer &&
+		Stage->In == In &&
+		Stage->Length == Length &&
+		Stage->ReportLength == ReportLength &&
+		Stage->Zlp == Zlp;
+}
+
+static
+VOID
+TestKinds(
+	VOID
+)
+{
+	CHECK_EQ(TrKindControl.Flags, 0);
+	CHECK_EQ(TrKindData.Flags, 0);
+	CHECK_EQ(TrKindAddress.Flags, TR_KIND_SET_ADDRESS);
+	CHECK_EQ(TrKindClearTt.Flags, TR_KIND_CLEAR_TT);
+
+	// the driver's own requests are control transfers like any other
+	CHECK(TrKindAddress.Stages == TrKindControl.Stages);
+	CHECK(TrKindClearTt.Stages == TrKindControl.Stages);
+
+	CHECK(TrKindControl.StageCount <= TR_MAX_STAGES);
+	CHECK(TrKindData.StageCount <= TR_MAX_STAGES);
+}
+
+static
+VOID
+TestControl(
+	const TR_KIND* Kind
+)
+{
+	//
+	// SETUP out, then the data stage if there is data, then a zero length
+	// DATA1 status stage the other way, or IN without data. No ZLP, the
+	// status stage ends the transfer.
+	//
+	for (ULONG m = 0; m < RTL_NUMBER_OF(MaxPacketSizes); m++)
+	{
+		for (ULONG length = 0; length <= MAX_LENGTH; length++)
+		{
+			for (int in = 0; in < 2; in++)
+			{
+				for (int shortOk = 0; shortOk < 2; shortOk++)
+				{
+					TR_STAGE_LAYOUT layout[TR_MAX_STAGES];
+					ULONG count = TR_LayoutStages(Kind, (BOOLEAN)in, length, MaxPacketSizes[m], (BOOLEAN)shortOk, layout);
+					BOOLEAN ok = count == (length ? 3u : 2u) &&
+						SameStage(&layout[0], StagePidSetup, StageBufferSetup, FALSE, 8, FALSE, FALSE) &&
+						SameStage(&layout[count - 1], StagePidData1, StageBufferStatus, length ? !in : TRUE, 0, FALSE, FALSE);
+
+					if (ok && length)
+					{
+						ok = SameStage(&layout[1], StagePidData1, StageBufferTransfer, (BOOLEAN)in, length, TRUE, FALSE);
+					}
+
+					if (!ok)
+					{
+						CHECK_EQ(MaxPacketSizes[m], 0);
+						CHECK_EQ(length, 0);
+						CHECK_EQ(in, -1);
+						CHECK_EQ(shortOk, -1);
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+static
+VOID
+TestData(
+	VOID
+)
+{
+	//
+	// One stage on the endpoint's toggle. An OUT transfer that ends on a
+	// full packet gets a ZLP if the client asked for short transfers; IN,
+	// empty and partly filled last packets never do.
+	//
+	for (ULONG m = 0; m < RTL_NUMBER_OF(MaxPacketSizes); m++)
+	{
+		for (ULONG length = 0; length <= MAX_LENGTH; length++)
+		{
+			for (int in = 0; in < 2; in++)
+			{
+				for (int shortOk = 0; shortOk < 2; shortOk++)
+				{
+					TR_STAGE_LAYOUT layout[TR_MAX_STAGES];
+					ULONG count = TR_LayoutStages(&TrKindData, (BOOLEAN)in, length, MaxPacketSizes[m], (BOOLEAN)shortOk, layout);
+					BOOLEAN zlp = !in && shortOk && length != 0 && (length % MaxPacketSizes[m]) == 0;
+
+					if (count != 1 ||
+						!SameStage(&layout[0], StagePidToggle, StageBufferTransfer, (BOOLEAN)in, length, TRUE, zlp))
+					{
+						CHECK_EQ(MaxPacketSizes[m], 0);
+						CHECK_EQ(length, 0);
+						CHECK_EQ(in, -1);
+						CHECK_EQ(shortOk, -1);
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+static
+VOID
+TestExamples(
+	VOID
+)
+{
+	TR_STAGE_LAYOUT layout[TR_MAX_STAGES];
+
+	// GET_DESCRIPTOR: SETUP, DATA1 IN, status OUT
+	CHECK_EQ(TR_LayoutStages(&TrKindControl, TRUE, 18, 64, TRUE, layout), 3);
+	CHECK(layout[1].In);
+	CHECK(!layout[2].In);
+
+	// SET_ADDRESS: SETUP, status IN
+	CHECK_EQ(TR_LayoutStages(&TrKindAddress, FALSE, 0, 64, FALSE, layout), 2);
+	CHECK(layout[1].In);
+
+	// bulk OUT of exactly two packets, with and without short transfers
+	CHECK_EQ(TR_LayoutStages(&TrKindData, FALSE, 1024, 512, TRUE, layout), 1);
+	CHECK(layout[0].Zlp);
+	CHECK_EQ(TR_LayoutStages(&TrKindData, FALSE, 1024, 512, FALSE, layout), 1);
+	CHECK(!layout[0].Zlp);
+}
+
+int
+main(
+	VOID
+)
+{
+	TestKinds();
+	TestControl(&TrKindControl);
+	TestControl(&TrKindAddress);
+	TestControl(&TrKindClearTt);
+	TestData();
+	TestExamples();
+
+	return TEST_RESULT();
+}
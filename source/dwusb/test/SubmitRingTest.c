@@ -0,0 +1,277 @@
+/*++
+
+Module Name:
+
+    SubmitRingTest.c
+
+Abstract:
+
+    Tests of the endpoint submit ring and run count, single threaded and
+    with several producers racing a runner chosen by the run count, as
+    in TR_RunChSm.
+
+--*/
+
+#include "host.h"
+#include "../SubmitRing.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+static
+VOID
+TestFill(
+	VOID
+)
+{
+	TR_SUBMIT_RING ring;
+	ULONG values[TR_SUBMIT_RING_SIZE];
+	ULONG slot;
+
+	SubmitRing_Init(&ring);
+
+	CHECK(!SubmitRing_Peek(&ring, &slot));
+
+	// many laps, so the sequence numbers wrap the slots over and over
+	for (ULONG lap = 0; lap < 100; lap++)
+	{
+		for (ULONG i = 0; i < TR_SUBMIT_RING_SIZE; i++)
+		{
+			CHECK(SubmitRing_Reserve(&ring, &slot));
+			values[slot] = lap * TR_SUBMIT_RING_SIZE + i;
+			SubmitRing_Publish(&ring, slot);
+		}
+
+		// full
+		CHECK(!SubmitRing_Reserve(&ring, &slot));
+
+		for (ULONG i = 0; i < TR_SUBMIT_RING_SIZE; i++)
+		{
+			CHECK(SubmitRing_Peek(&ring, &slot));
+			CHECK_EQ(values[slot], lap * TR_SUBMIT_RING_SIZE + i);
+			SubmitRing_Release(&ring, slot);
+		}
+
+		CHECK(!SubmitRing_Peek(&ring, &slot));
+	}
+}
+
+static
+VOID
+TestUnpublished(
+	VOID
+)
+{
+	TR_SUBMIT_RING ring;
+	ULONG first;
+	ULONG second;
+	ULONG slot;
+
+	SubmitRing_Init(&ring);
+
+	//
+	// A slot claimed but not yet published holds up the consumer, even
+	// with a later one published.
+	//
+	CHECK(SubmitRing_Reserve(&ring, &first));
+	CHECK(SubmitRing_Reserve(&ring, &second));
+	CHECK(first != second);
+
+	SubmitRing_Publish(&ring, second);
+	CHECK(!SubmitRing_Peek(&ring, &slot));
+
+	SubmitRing_Publish(&ring, first);
+
+	CHECK(SubmitRing_Peek(&ring, &slot));
+	CHECK_EQ(slot, first);
+	SubmitRing_Release(&ring, slot);
+
+	CHECK(SubmitRing_Peek(&ring, &slot));
+	CHECK_EQ(slot, second);
+	SubmitRing_Release(&ring, slot);
+
+	CHECK(!SubmitRing_Peek(&ring, &slot));
+}
+
+static
+VOID
+TestRunCount(
+	VOID
+)
+{
+	volatile LONG runCount = 0;
+
+	CHECK(RunCount_Enter(&runCount));
+
+	// callers arriving while the runner is busy don't run
+	CHECK(!RunCount_Enter(&runCount));
+	CHECK(!RunCount_Enter(&runCount));
+
+	// the pass that started before they came doesn't account for them
+	CHECK(!RunCount_Leave(&runCount, 1));
+
+	LONG pending = RunCount_Snapshot(&runCount);
+	CHECK_EQ(pending, 2);
+	CHECK(RunCount_Leave(&runCount, pending));
+
+	CHECK_EQ(runCount, 0);
+	CHECK(RunCount_Enter(&runCount));
+	CHECK(RunCount_Leave(&runCount, RunCount_Snapshot(&runCount)));
+}
+
+//
+// The stress test: each producer pushes STRESS_ITEMS values tagged with
+// its number and a sequence, and then runs the consumer like
+// Controller_InvokeTrSm does. Whichever thread becomes the runner drains
+// the ring. Every value has to come out exactly once, each producer's in
+// order, and nothing may be left behind once all producers are done.
+//
+#define STRESS_PRODUCERS 4
+#define STRESS_ITEMS 200000
+
+typedef struct _STRESS {
+	TR_SUBMIT_RING Ring;
+	ULONG Values[TR_SUBMIT_RING_SIZE];
+	volatile LONG RunCount;
+
+	// only touched by the runner
+	ULONG NextSequence[STRESS_PRODUCERS];
+	ULONG Consumed;
+	ULONG OutOfOrder;
+	volatile LONG Runners;
+	volatile LONG Overlaps;
+} STRESS;
+
+static STRESS Stress;
+
+static
+VOID
+StressRun(
+	VOID
+)
+{
+	LONG pending;
+	ULONG slot;
+
+	if (!RunCount_Enter(&Stress.RunCount))
+	{
+		return;
+	}
+
+	do
+	{
+		pending = RunCount_Snapshot(&Stress.RunCount);
+
+		// there is only ever one runner
+		if (InterlockedIncrement(&Stress.Runners) != 1)
+		{
+			InterlockedIncrement(&Stress.Overlaps);
+		}
+
+		while (SubmitRing_Peek(&Stress.Ring, &slot))
+		{
+			ULONG value = Stress.Values[slot];
+			ULONG producer = value >> 24;
+			ULONG sequence = value & 0xFFFFFF;
+
+			SubmitRing_Release(&Stress.Ring, slot);
+
+			if (producer >= STRESS_PRODUCERS || sequence != Stress.NextSequence[producer])
+			{
+				Stress.OutOfOrder++;
+			}
+			else
+			{
+				Stress.NextSequence[producer]++;
+			}
+
+			Stress.Consumed++;
+		}
+
+		InterlockedExchangeAdd(&Stress.Runners, -1);
+
+	} while (!RunCount_Leave(&Stress.RunCount, pending));
+}
+
+static
+void*
+StressProducer(
+	void* Context
+)
+{
+	ULONG producer = (ULONG)(uintptr_t)Context;
+	ULONG slot;
+
+	for (ULONG i = 0; i < STRESS_ITEMS; i++)
+	{
+		while (!SubmitRing_Reserve(&Stress.Ring, &slot))
+		{
+			// full, the driver fails the request here, the test tries again
+			StressRun();
+			sched_yield();
+		}
+
+		Stress.Values[slot] = (producer << 24) | i;
+
+		// now and then, leave the slot claimed but unpublished for a while
+		if ((i & 63) == 0)
+		{
+			sched_yield();
+		}
+
+		SubmitRing_Publish(&Stress.Ring, slot);
+
+		StressRun();
+	}
+
+	return NULL;
+}
+
+static
+VOID
+TestStress(
+	VOID
+)
+{
+	pthread_t threads[STRESS_PRODUCERS];
+	ULONG slot;
+
+	memset(&Stress, 0, sizeof(Stress));
+	SubmitRing_Init(&Stress.Ring);
+
+	for (ULONG i = 0; i < STRESS_PRODUCERS; i++)
+	{
+		CHECK(pthread_create(&threads[i], NULL, StressProducer, (void*)(uintptr_t)i) == 0);
+	}
+
+	for (ULONG i = 0; i < STRESS_PRODUCERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	CHECK_EQ(Stress.Consumed, STRESS_PRODUCERS * STRESS_ITEMS);
+	CHECK_EQ(Stress.OutOfOrder, 0);
+	CHECK_EQ(Stress.Overlaps, 0);
+	CHECK_EQ(Stress.RunCount, 0);
+
+	for (ULONG i = 0; i < STRESS_PRODUCERS; i++)
+	{
+		CHECK_EQ(Stress.NextSequence[i], STRESS_ITEMS);
+	}
+
+	// no push went unseen by a runner
+	CHECK(!SubmitRing_Peek(&Stress.Ring, &slot));
+}
+
+int
+main(
+	VOID
+)
+{
+	TestFill();
+	TestUnpublished();
+	TestRunCount();
+	TestStress();
+
+	return TEST_RESULT();
+}
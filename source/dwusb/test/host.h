@@ -0,0 +1,86 @@
+/*++
+
+Module Name:
+
+    host.h
+
+Abstract:
+
+    Just enough of the kernel's types and primitives to build the driver's
+    plain data headers into host test programs.
+
+Environment:
+
+    User mode, gcc or clang
+
+--*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+
+#define FORCEINLINE static inline
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+#define RTL_NUMBER_OF(a) (sizeof(a) / sizeof((a)[0]))
+#define UNREFERENCED_PARAMETER(x) (void)(x)
+#define RtlZeroMemory(d, n) memset((d), 0, (n))
+#define NT_ASSERT(x) CHECK(x)
+
+typedef void* PVOID;
+typedef unsigned char UCHAR, UINT8, BOOLEAN;
+typedef unsigned short USHORT;
+typedef int INT;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+FORCEINLINE LONG InterlockedIncrement(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(volatile LONG* p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchangeAdd(volatile LONG* p, LONG v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange(volatile LONG* p, LONG v, LONG c)
+{
+	__atomic_compare_exchange_n(p, &c, v, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return c;
+}
+
+//
+// Failed checks are counted and reported, the program exits non-zero if
+// there were any.
+//
+static int TestFailures;
+
+#define CHECK(x) \
+	do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #x); \
+			TestFailures++; \
+		} \
+	} while (0)
+
+#define CHECK_EQ(a, b) \
+	do { \
+		long long a_ = (long long)(a), b_ = (long long)(b); \
+		if (a_ != b_) { \
+			fprintf(stderr, "%s:%d: %s: %s == %lld, expected %lld\n", __FILE__, __LINE__, __func__, #a, a_, b_); \
+			TestFailures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT() \
+	(printf("%s: %s\n", __FILE__, TestFailures ? "FAILED" : "passed"), TestFailures != 0)